@@ -25,187 +25,1833 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <memory>
 #include <unordered_map>
+#include <string.h>
+#include <errno.h>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <filesystem>
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <cinttypes>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#define HAS_PERF_EVENTS
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#define HAS_TSC
+#endif
 
 #include "custom_instr.h"
 
 using namespace std;
 
+static_assert((LOG_RING_SIZE & (LOG_RING_SIZE - 1)) == 0, "LOG_RING_SIZE must be a power of two");
+static_assert((SHM_RING_SIZE & (SHM_RING_SIZE - 1)) == 0, "SHM_RING_SIZE must be a power of two");
+static_assert((ALLOC_TABLE_SHARDS & (ALLOC_TABLE_SHARDS - 1)) == 0, "ALLOC_TABLE_SHARDS must be a power of two");
+
+/*
+	An event as buffered by the instrumented thread.
+	Formatting (text or binary) is left to the flusher.
+*/
+struct log_event {
+	uint64_t timestamp;
+	// See record_nargs
+	uint64_t args[5];
+	uint32_t span_id;
+	event_type type;
+	uint8_t flags;
+	string text;
+};
+
+/*
+	Single-producer/single-consumer ring of events.
+	The owning thread is the only producer, dump_log
+	(under dump_guard) is the only consumer.
+*/
+struct log_ring {
+	log_event events[LOG_RING_SIZE];
+	atomic<size_t> head{0};
+	atomic<size_t> tail{0};
+	atomic<bool> retired{false};
+};
+
+/*
+	Marks the ring of an exiting thread as retired,
+	so that it can be released once it has been drained.
+*/
+struct ring_owner {
+	log_ring * ring = nullptr;
+
+	~ring_owner() {
+		if (ring) {
+			ring->retired.store(true, memory_order_release);
+		}
+	}
+};
+
+struct span_memory {
+	atomic<uint64_t> allocated{0};
+	atomic<uint64_t> freed{0};
+	// Signed, since a span can free blocks allocated by others
+	atomic<int64_t> live{0};
+	atomic<int64_t> peak{0};
+};
+
+/*
+	Events logged on a span from other threads than the one it is
+	attached to, logged by instrum_finish before its end.
+*/
+struct span_foreign {
+	mutex guard;
+	bool finished = false;
+	vector<log_event> events;
+};
+
+// Counters of a perf_group: the hardware ones, then the software ones,
+// in the order of the arguments of the PERF_HW and PERF_SW events
+#define PERF_NUM_COUNTERS 7
+#define PERF_NUM_HW_COUNTERS 4
+
+struct span_counters {
+	uint64_t values[PERF_NUM_COUNTERS];
+	// Time the group was enabled and actually counting,
+	// which differ when the kernel multiplexes the counters
+	uint64_t time_enabled;
+	uint64_t time_running;
+	// Counted on the threads the span was suspended from, see instrum_suspend
+	uint64_t carried[PERF_NUM_COUNTERS] = {};
+	// Whether the values above were read on the thread the span is attached to
+	bool counting = true;
+	// Whether some thread the span ran on counted hardware, or software,
+	// events, so that what it carried is logged wherever it finishes
+	bool hw_counted = false;
+	bool sw_counted = false;
+};
+
+/*
+	perf_event_open counters of a thread, opened as one group
+	on its first span. Those the kernel refuses are left out.
+*/
+struct perf_group {
+	bool opened = false;
+	int leader = -1;
+	int fds[PERF_NUM_COUNTERS];
+	// Position of each counter in a read of the group, -1 if left out
+	int index[PERF_NUM_COUNTERS];
+	int num_counted = 0;
+
+	perf_group() {
+		fill(begin(fds), end(fds), -1);
+		fill(begin(index), end(index), -1);
+	}
+
+	~perf_group() {
+		for (int fd : fds) {
+			if (fd >= 0) {
+				close(fd);
+			}
+		}
+	}
+};
+
+// Latency histograms are exact below METRICS_SUB_BUCKETS ns, then
+// split each power of two in METRICS_SUB_BUCKETS, up to 2^64 ns
+#define METRICS_SUB_BUCKETS 8
+#define METRICS_BUCKETS ((64 - 2) * METRICS_SUB_BUCKETS)
+
+/*
+	Aggregates of the runs of a function that finished in one
+	slot of time, or since startup.
+*/
+struct metrics_slot {
+	// Slot number the counters are for, see update_live_metrics
+	atomic<uint64_t> epoch{0};
+	atomic<uint64_t> count{0};
+	atomic<uint64_t> total_time{0};
+	atomic<uint64_t> max_time{0};
+	atomic<uint64_t> allocated{0};
+	atomic<uint64_t> lock_wait{0};
+	atomic<uint64_t> histogram[METRICS_BUCKETS] = {};
+};
+
+struct func_live_metrics {
+	metrics_slot total;
+	metrics_slot window[METRICS_WINDOW_SLOTS];
+};
+
+struct lock_stats {
+	string name;
+	// Where the mutex was initialized, e.g. jung_client.cc:217
+	string site;
+	// Only updated by the holder of the mutex, so plain
+	// loads and stores are enough. See bump_stat
+	atomic<uint64_t> acquisitions{0};
+	atomic<uint64_t> contended{0};
+	atomic<uint64_t> wait_time{0};
+	atomic<uint64_t> hold_time{0};
+	atomic<uint64_t> wait_histogram[LOCK_HISTOGRAM_BUCKETS] = {};
+	atomic<uint64_t> hold_histogram[LOCK_HISTOGRAM_BUCKETS] = {};
+};
+
+/*
+	Part of the table of allocation sizes, each one
+	on its own cache line to avoid false sharing.
+*/
+struct alignas(64) alloc_shard {
+	mutex guard;
+	unordered_map<void*, size_t> sizes;
+};
+
 ofstream log_p;
-unordered_map<string, chrono::time_point<chrono::steady_clock>> start_times;
-unordered_map<string, int> uid_list;
-mutex log_guard, dump_guard, uid_guard;
-vector<string> log_buffer;
-Side side_p;
+Log_format log_format_p = LOG_FORMAT;
+Log_sink log_sink_p = LOG_SINK;
+// Shared-memory ring of the log, see set_log_sink
+shm_ring_header * shm_ring = nullptr;
+char * shm_data = nullptr;
+// Set when a batch is dropped, see dump_log
+atomic<bool> resync_log{false};
+// Segment file of the log being written, see write_segment
+int segment_fd = -1;
+char * segment_data = nullptr;
+size_t segment_size = 0;
+size_t segment_used = 0;
+uint64_t segment_start = 0;
+// Number of the next segment, 0 until the directory is scanned
+uint32_t segment_seq = 0;
+bool segment_continued = false;
+Time_unit time_unit_p = TIME_UNIT;
+
+// Timestamp 0 of the log, on the steady clock and on the wall clock
+const chrono::steady_clock::time_point steady_base = chrono::steady_clock::now();
+const uint64_t log_time_base = chrono::duration_cast<chrono::nanoseconds>(
+	chrono::system_clock::now().time_since_epoch()).count();
+
+Clock_source clock_source_p = steady_clock_source;
+bool clock_selected = false;
+// Calibration of the TSC: ns = tsc_base_ns + (ticks - tsc_base) * tsc_mult / 2^32
+uint64_t tsc_base, tsc_base_ns, tsc_mult;
+// Events drained from the rings, and the batch currently being written to disk
+string drain_buffer, write_buffer;
+// Names of the spans still open, needed to render text logs
+unordered_map<uint32_t, string> span_names;
+// Also numbers the RPCs, so that global span and RPC ids never collide
+atomic<uint32_t> next_span_id{0};
+// High half of the global ids of the process, positive as an int64_t
+const uint32_t process_tag = random_device{}() % 0x7fffffff + 1;
+thread_local ring_owner local_ring;
+// Spans started by the thread and not finished yet, innermost last
+thread_local vector<span> span_stack;
+thread_local bool instrum_busy = false;
+// Interned function names, with the last uid given to each function
+unordered_map<string, uint32_t> func_ids;
+vector<string> func_names;
+vector<uint32_t> func_uids;
+// Function names already known to the flusher
+vector<string> flushed_func_names;
+mutex dump_guard, write_guard, func_guard, ring_guard;
+alloc_shard alloc_table[ALLOC_TABLE_SHARDS];
+// Blocks in alloc_table, so that blocks freed outside of a span are
+// only looked up when some might be there, see instrum_forget_alloc
+atomic<uint64_t> tracked_allocs{0};
+// Stats of all the custom mutexes initialized so far
+vector<unique_ptr<lock_stats>> lock_stats_list;
+mutex lock_stats_guard;
+vector<unique_ptr<log_ring>> log_rings;
+// Side of all the spans of the process, set by the first one (-1 until then)
+atomic<int> side_p{-1};
+
+thread flusher;
+once_flag flusher_once;
+mutex flush_guard;
+condition_variable flush_cv;
+bool flusher_stop = false;
+atomic<bool> flush_pending{false};
+atomic<uint32_t> flush_interval{FLUSH_INTERVAL_MS};
+atomic<size_t> flush_threshold{FLUSH_THRESHOLD};
+
+atomic<Sampling_mode> sampling_mode{SAMPLING_MODE};
+atomic<uint32_t> sample_every{SAMPLING_MODE == sample_every_n ? (uint32_t)SAMPLING_PARAM : 1};
+// Probability of recording a run, as a fraction of 2^32
+atomic<uint64_t> sample_threshold{(uint64_t)((SAMPLING_MODE == sample_probability ? SAMPLING_PARAM : 1) * 4294967296.0)};
+// Target of the adaptive sampling, in events per second
+atomic<double> sampling_budget{SAMPLING_PARAM};
+// Events drained from the rings so far, to measure the event rate
+atomic<uint64_t> events_drained{0};
+thread_local uint64_t sample_count, sample_rng;
+
+atomic<bool> instrum_categories[NUM_CATEGORIES] = {
+	{instrum_compiled(spans_category)}, {instrum_compiled(memory_category)}, {instrum_compiled(locks_category)}
+};
+
+atomic<bool> perf_counters_p{PERF_COUNTERS};
+thread_local perf_group local_perf;
+atomic<bool> live_metrics_p{LIVE_METRICS};
+// Indexed by function id, allocated on the first finished span
+atomic<func_live_metrics *> live_metrics[METRICS_MAX_FUNCTIONS];
+// See thread_usage
+thread_local uint64_t thread_lock_wait = 0;
+
+/*
+	Marks the calling thread as running the instrumentation
+	for the lifetime of the object, see instrum_active_span.
+*/
+struct busy_scope {
+	bool previous;
+
+	busy_scope() : previous(instrum_busy) {
+		instrum_busy = true;
+	}
+
+	~busy_scope() {
+		instrum_busy = previous;
+	}
+};
+
+/*
+	Returns the log ring of the calling thread,
+	registering a new one on first use.
+*/
+static log_ring * get_local_ring() {
+	if (!local_ring.ring) {
+		auto ring = make_unique<log_ring>();
+		local_ring.ring = ring.get();
+		lock_guard<mutex> lock(ring_guard);
+		log_rings.push_back(move(ring));
+	}
+	return local_ring.ring;
+}
+
+static uint64_t read_steady_clock();
+static void close_segment();
+static void drain_func_names();
+static void drain_ring(log_ring * ring);
+
+/*
+	Scales the probability of the adaptive sampling by how far
+	the event rate since the last call is from the budget.
+	Only called by the flusher.
+*/
+static void adapt_sampling() {
+	static uint64_t last_time = read_steady_clock(), last_events = 0;
+	uint64_t now = read_steady_clock();
+	uint64_t events = events_drained.load();
+	if (sampling_mode.load() != sample_adaptive || now == last_time) {
+		return;
+	}
+
+	double rate = (events - last_events) * 1e9 / (now - last_time);
+	double probability = sample_threshold.load() / 4294967296.0;
+	// Grow at most twofold per round, so that a quiet interval
+	// does not let the next burst through unsampled
+	double target = probability * 2;
+	if (rate > 0) {
+		target = min(target, probability * sampling_budget.load() / rate);
+	}
+	target = max(MIN_SAMPLING_PROBABILITY, min(1.0, target));
+	sample_threshold = (uint64_t)(target * 4294967296.0);
+	last_time = now;
+	last_events = events;
+}
+
+/*
+	Body of the background flusher thread: dumps the log
+	every flush_interval ms, or earlier if a thread asks for it.
+*/
+static void flusher_loop() {
+	uint64_t last_lock_stats = read_steady_clock();
+	unique_lock<mutex> lock(flush_guard);
+	while (!flusher_stop) {
+		flush_cv.wait_for(lock, chrono::milliseconds(flush_interval.load()), [] {
+			return flusher_stop || flush_pending.load();
+		});
+		flush_pending = false;
+		lock.unlock();
+		dump_log();
+		adapt_sampling();
+		if (read_steady_clock() - last_lock_stats >= (uint64_t)LOCK_STATS_INTERVAL_MS * 1000000) {
+			dump_lock_stats();
+			last_lock_stats = read_steady_clock();
+		}
+		lock.lock();
+	}
+}
+
+/*
+	Stops the flusher and writes whatever is left.
+	Registered with atexit so that nothing is lost on exit.
+*/
+static void stop_flusher() {
+	{
+		lock_guard<mutex> lock(flush_guard);
+		flusher_stop = true;
+	}
+	flush_cv.notify_one();
+
+	if (flusher.joinable()) {
+		// exit() might have been called by the flusher itself
+		if (flusher.get_id() == this_thread::get_id()) {
+			flusher.detach();
+		} else {
+			flusher.join();
+		}
+	}
+
+	dump_log();
+	dump_lock_stats();
+	lock_guard<mutex> lock(write_guard);
+	log_p.close();
+	close_segment();
+	if (shm_ring) {
+		shm_ring->closed.store(1, memory_order_release);
+	}
+}
+
+static void start_flusher() {
+	call_once(flusher_once, [] {
+		if (!clock_selected) {
+			set_clock_source(CLOCK_SOURCE);
+		}
+		flusher = thread(flusher_loop);
+		atexit(stop_flusher);
+	});
+}
+
+void set_flush_params(uint32_t interval_ms, size_t threshold) {
+	flush_interval = interval_ms;
+	flush_threshold = threshold;
+}
+
+void set_sampling(Sampling_mode mode, double param) {
+	if (mode == sample_every_n) {
+		sample_every = max(param, 1.0);
+	} else if (mode == sample_probability) {
+		sample_threshold = (uint64_t)(max(0.0, min(1.0, param)) * 4294967296.0);
+	} else if (mode == sample_adaptive) {
+		// Start from recording everything, the flusher lowers it
+		sampling_budget = param;
+		sample_threshold = (uint64_t)1 << 32;
+	}
+	sampling_mode = mode;
+}
+
+uint32_t instrum_sample() {
+	switch (sampling_mode.load(memory_order_relaxed)) {
+		case sample_every_n: {
+			uint32_t n = sample_every.load(memory_order_relaxed);
+			return sample_count++ % n == 0 ? n : 0;
+		}
+		case sample_probability:
+		case sample_adaptive: {
+			uint64_t threshold = sample_threshold.load(memory_order_relaxed);
+			if (!sample_rng) {
+				sample_rng = (hash<thread::id>()(this_thread::get_id()) ^ read_steady_clock()) | 1;
+			}
+			// xorshift64*, its upper 32 bits are uniform
+			sample_rng ^= sample_rng >> 12;
+			sample_rng ^= sample_rng << 25;
+			sample_rng ^= sample_rng >> 27;
+			if ((sample_rng * 0x2545f4914f6cdd1dULL) >> 32 >= threshold) {
+				return 0;
+			}
+			return max((uint64_t)1, (((uint64_t)1 << 32) + threshold / 2) / threshold);
+		}
+		default:
+			return 1;
+	}
+}
+
+void set_log_format(Log_format format) {
+	log_format_p = format;
+}
+
+void set_log_sink(Log_sink sink) {
+	log_sink_p = sink;
+	if (sink != file_sink) {
+		log_format_p = binary_format;
+	}
+}
+
+void set_time_unit(Time_unit unit) {
+	time_unit_p = unit;
+}
+
+static uint64_t read_steady_clock() {
+	return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - steady_base).count();
+}
+
+uint64_t read_clock() {
+#ifdef HAS_TSC
+	if (clock_source_p == tsc_clock_source) {
+		uint64_t ticks = __rdtsc() - tsc_base;
+		return tsc_base_ns + (uint64_t)(((unsigned __int128)ticks * tsc_mult) >> 32);
+	}
+#endif
+	return read_steady_clock();
+}
+
+bool set_clock_source(Clock_source source) {
+	clock_selected = true;
+	if (source == steady_clock_source) {
+		clock_source_p = steady_clock_source;
+		return true;
+	}
+
+#ifdef HAS_TSC
+	// Only an invariant TSC ticks at a constant rate on all cores and in all power states
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1 << 8))) {
+		return false;
+	}
+
+	// Measure the TSC frequency against the steady clock
+	uint64_t start_ns = read_steady_clock();
+	uint64_t start_ticks = __rdtsc();
+	this_thread::sleep_for(chrono::milliseconds(TSC_CALIBRATION_MS));
+	uint64_t end_ns = read_steady_clock();
+	uint64_t end_ticks = __rdtsc();
+
+	tsc_mult = ((end_ns - start_ns) << 32) / (end_ticks - start_ticks);
+	tsc_base = end_ticks;
+	tsc_base_ns = end_ns;
+	clock_source_p = tsc_clock_source;
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*
+	Converts a time in ns to the unit of the log.
+*/
+static uint64_t to_time_unit(uint64_t ns) {
+	return ns / time_unit_ns(time_unit_p);
+}
+
+/*
+	Appends the event to the buffer of the calling thread.
+*/
+static void push_event(log_event & event) {
+	log_ring * ring = get_local_ring();
+	size_t head = ring->head.load(memory_order_relaxed);
+	size_t tail = ring->tail.load(memory_order_acquire);
+	// Ring full: the flusher is lagging behind, drain it ourselves
+	while (head - tail >= LOG_RING_SIZE) {
+		dump_log();
+		tail = ring->tail.load(memory_order_acquire);
+	}
+
+	ring->events[head & (LOG_RING_SIZE - 1)] = move(event);
+	ring->head.store(head + 1, memory_order_release);
+
+	// Wake up the flusher early. A missed wakeup only delays
+	// the flush until the next interval
+	if (head + 1 - tail >= flush_threshold.load(memory_order_relaxed) && !flush_pending.exchange(true)) {
+		flush_cv.notify_one();
+	}
+}
+
+/*
+	Timestamps the event relative to the start of its span.
+*/
+static log_event make_event(const span & s, event_type type, uint8_t flags = 0, uint64_t arg0 = 0, 
+ uint64_t arg1 = 0, uint64_t arg2 = 0, uint64_t arg3 = 0, uint64_t arg4 = 0, string text = "") {
+	log_event event;
+	event.timestamp = type == FUNC_START ? s.start_time : read_clock() - s.start_time;
+	event.args[0] = arg0;
+	event.args[1] = arg1;
+	event.args[2] = arg2;
+	event.args[3] = arg3;
+	event.args[4] = arg4;
+	event.span_id = s.id;
+	event.type = type;
+	event.flags = flags;
+	event.text = move(text);
+	return event;
+}
+
+/*
+	Timestamps the event relative to the start of its span
+	and buffers it.
+*/
+static void record_event(const span & s, event_type type, uint8_t flags = 0, uint64_t arg0 = 0, 
+ uint64_t arg1 = 0, uint64_t arg2 = 0, uint64_t arg3 = 0, uint64_t arg4 = 0, string text = "") {
+	// Lock stats are also kept for the spans that are not recorded
+	if (!s.id) {
+		return;
+	}
+	log_event event = make_event(s, type, flags, arg0, arg1, arg2, arg3, arg4, move(text));
+	push_event(event);
+}
+
+/*
+	Formats the event as a line of the text log.
+*/
+static void render_text(const log_event & event, string & out) {
+	if (event.type == FUNC_START) {
+		// e.g. do_stuff12, or Greet3 17 on the server side
+		string name = flushed_func_names[event.args[0]] + to_string(event.args[1]);
+		if (event.args[2] > 0) {
+			name += " " + to_string(event.args[2] - 1);
+		}
+		span_names[event.span_id] = name;
+	}
+
+	out += to_string(to_time_unit(event.timestamp));
+	out += ' ';
+	out += span_names[event.span_id];
+	if (event.type != USER_EVENT) {
+		out += ' ';
+		out += event_name(event.type);
+	}
+	if (event.type == FUNC_START && event.args[3] > 1) {
+		// Sampled span, e.g. [1/8]
+		out += " [1/" + to_string(event.args[3]) + "]";
+	}
+	auto parent = event.type == FUNC_START ? span_names.find(event.args[4]) : span_names.end();
+	if (parent != span_names.end()) {
+		// Nested span, e.g. [parent=Greet3], without the RPC id
+		out += " [parent=" + parent->second.substr(0, parent->second.find(' ')) + "]";
+	}
+	for (int i = 0; i < event_nargs(event.type); ++i) {
+		out += ' ';
+		out += to_string(event_args_are_time(event.type) ? to_time_unit(event.args[i]) : event.args[i]);
+	}
+	if (event.type == MUTEX_UNLOCK && event.flags == UNLOCK_COND_WAIT) {
+		out += " [cond_wait]";
+	} else if (event.type == MUTEX_UNLOCK && event.flags == UNLOCK_COND_TIMEDWAIT) {
+		out += " [cond_timedwait]";
+	}
+	if (!event.text.empty()) {
+		out += ' ';
+		out += event.text;
+	}
+	out += '\n';
+
+	if (event.type == FUNC_END) {
+		span_names.erase(event.span_id);
+	}
+}
+
+/*
+	Formats the header of the log: a log_file_header
+	for binary logs, a comment line for text ones.
+*/
+static void render_header(string & out, uint8_t flags) {
+	int side = side_p.load();
+	if (log_format_p == binary_format) {
+		log_file_header header = {};
+		memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+		header.version = LOG_VERSION;
+		header.side = side;
+		header.time_unit = time_unit_p;
+		header.clock_source = clock_source_p;
+		header.flags = flags;
+		header.time_base = log_time_base;
+		header.process_tag = process_tag;
+		out.append((const char *)&header, sizeof(header));
+	} else {
+		out += "# jung v" + to_string(LOG_VERSION) + " side=" + (side == server ? "server" : "client") + 
+			" unit=" + time_unit_name(time_unit_p) + 
+			" clock=" + (clock_source_p == tsc_clock_source ? "tsc" : "steady") + 
+			" base=" + to_string(log_time_base) + " process=" + to_string(process_tag) + '\n';
+	}
+}
+
+/*
+	Creates the shared-memory ring of the log, replacing the one
+	of a previous run, if any. A collector still attached to that
+	one sees it closed.
+*/
+static void open_shm_ring(const char * name) {
+	shm_unlink(name);
+	int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	size_t size = sizeof(shm_ring_header) + SHM_RING_SIZE;
+	void * mem = fd < 0 || ftruncate(fd, size) != 0 ? MAP_FAILED : 
+		mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (fd >= 0) {
+		close(fd);
+	}
+	// quick_exit skips the atexit flush, which would fail the same way
+	if (mem == MAP_FAILED) {
+		cerr << "Error: cannot create shared memory log " << name << endl;
+		quick_exit(EXIT_FAILURE);
+	}
+
+	// The new segment is zero-filled
+	shm_ring = (shm_ring_header *)mem;
+	shm_data = (char *)mem + sizeof(shm_ring_header);
+	shm_ring->version = LOG_VERSION;
+	shm_ring->pid = getpid();
+	shm_ring->capacity = SHM_RING_SIZE;
+	// The collector waits for the magic before reading the rest
+	atomic_thread_fence(memory_order_release);
+	memcpy(shm_ring->magic, SHM_MAGIC, sizeof(shm_ring->magic));
+}
+
+/*
+	Copies the batch into the shared-memory ring, or drops it
+	if the collector is too far behind to make room for it.
+*/
+static void write_shm_ring(const string & batch) {
+	uint64_t head = shm_ring->head.load(memory_order_relaxed);
+	uint64_t tail = shm_ring->tail.load(memory_order_acquire);
+	if (batch.size() > shm_ring->capacity - (head - tail)) {
+		shm_ring->dropped_batches.fetch_add(1, memory_order_relaxed);
+		shm_ring->dropped_bytes.fetch_add(batch.size(), memory_order_relaxed);
+		resync_log = true;
+		return;
+	}
+
+	size_t offset = head & (shm_ring->capacity - 1);
+	size_t first = min(batch.size(), (size_t)(shm_ring->capacity - offset));
+	memcpy(shm_data + offset, batch.data(), first);
+	memcpy(shm_data, batch.data() + first, batch.size() - first);
+	shm_ring->head.store(head + batch.size(), memory_order_release);
+}
+
+/*
+	Encodes the event as a record of the binary log.
+*/
+static void render_binary(const log_event & event, string & out) {
+	string payload;
+	put_varint(payload, to_time_unit(event.timestamp));
+	for (int i = 0; i < record_nargs(event.type); ++i) {
+		put_varint(payload, event_args_are_time(event.type) ? to_time_unit(event.args[i]) : event.args[i]);
+	}
+	if (event_has_text(event.type)) {
+		// Leave room for the length prefix in the 16 bit payload size
+		size_t text_len = min(event.text.size(), (size_t)UINT16_MAX - payload.size() - 3);
+		put_varint(payload, text_len);
+		payload.append(event.text, 0, text_len);
+	}
+
+	record_header header;
+	header.type = event.type;
+	header.flags = event.flags;
+	header.payload_len = payload.size();
+	header.span_id = event.span_id;
+	out.append((const char *)&header, sizeof(header));
+	out += payload;
+}
+
+/*
+	Unmaps the current segment, giving back the preallocated
+	space it did not use.
+*/
+static void close_segment() {
+	if (!segment_data) {
+		return;
+	}
+	munmap(segment_data, segment_size);
+	if (ftruncate(segment_fd, segment_used) != 0) {
+		cerr << "Warning: cannot truncate log segment" << endl;
+	}
+	close(segment_fd);
+	segment_data = nullptr;
+	segment_fd = -1;
+}
+
+/*
+	Starts a new segment with room for at least the given batch,
+	numbered after the ones already in the directory, so that
+	the segments of several runs sort in order.
+*/
+static void open_segment(int side, size_t batch_size) {
+	close_segment();
+	const char * dir = side == server ? SERVER_SEGDIR : CLIENT_SEGDIR;
+	if (segment_seq == 0) {
+		error_code error;
+		filesystem::create_directories(dir, error);
+		for (auto & entry : filesystem::directory_iterator(dir, error)) {
+			segment_seq = max(segment_seq, (uint32_t)strtoul(entry.path().filename().c_str(), nullptr, 10));
+		}
+		++segment_seq;
+	}
+
+	// Every segment can be read on its own, names included
+	string prologue;
+	render_header(prologue, segment_continued ? LOG_FLAG_CONTINUED : 0);
+	{
+		lock_guard<mutex> lock(func_guard);
+		for (size_t id = 0; id < func_names.size(); ++id) {
+			log_event event = {};
+			event.type = FUNC_NAME;
+			event.args[0] = id;
+			event.text = func_names[id];
+			render_binary(event, prologue);
+		}
+	}
+
+	char path[256];
+	snprintf(path, sizeof(path), "%s/%08u.bin", dir, segment_seq++);
+	segment_size = max((size_t)SEGMENT_SIZE, prologue.size() + batch_size);
+	segment_fd = open(path, O_CREAT | O_EXCL | O_RDWR, 0644);
+	void * mem = segment_fd < 0 || posix_fallocate(segment_fd, 0, segment_size) != 0 ? MAP_FAILED :
+		mmap(nullptr, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, segment_fd, 0);
+	// quick_exit skips the atexit flush, which would fail the same way
+	if (mem == MAP_FAILED) {
+		cerr << "Error: cannot create log segment " << path << endl;
+		quick_exit(EXIT_FAILURE);
+	}
+
+	segment_data = (char *)mem;
+	memcpy(segment_data, prologue.data(), prologue.size());
+	segment_used = prologue.size();
+	segment_start = read_steady_clock();
+	segment_continued = true;
+}
+
+/*
+	Copies the batch into the current segment,
+	starting a new one if it is full or too old.
+*/
+static void write_segment(int side, const string & batch) {
+	bool expired = SEGMENT_DURATION_S > 0 && 
+		read_steady_clock() - segment_start >= (uint64_t)SEGMENT_DURATION_S * 1000000000;
+	if (!segment_data || expired || segment_used + batch.size() > segment_size) {
+		open_segment(side, batch.size());
+	}
+	memcpy(segment_data + segment_used, batch.data(), batch.size());
+	segment_used += batch.size();
+}
+
+void set_instrum_category(Instrum_category category, bool enabled) {
+	instrum_categories[category] = enabled && instrum_compiled(category);
+}
+
+/*
+	Takes a snapshot of the resource usage of the calling thread.
+*/
+static void read_thread_usage(thread_usage & usage) {
+	rusage data;
+	// RUSAGE_THREAD is not defined on darwin, so we fallback on SELF for portability.
+	// Process stats like pagefaults will be off, but at least we get _something_
+	#ifdef RUSAGE_THREAD
+		getrusage(RUSAGE_THREAD, &data);
+	#else
+		getrusage(RUSAGE_SELF, &data);
+	#endif
+	// Unlike the rusage times, not rounded to the scheduler tick
+	timespec cpu_time = {};
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_time);
+
+	usage.minor_faults = data.ru_minflt;
+	usage.major_faults = data.ru_majflt;
+	usage.cpu_time = cpu_time.tv_sec * 1000000000ULL + cpu_time.tv_nsec;
+	usage.user_time = data.ru_utime.tv_sec * 1000000000ULL + data.ru_utime.tv_usec * 1000ULL;
+	usage.system_time = data.ru_stime.tv_sec * 1000000000ULL + data.ru_stime.tv_usec * 1000ULL;
+	usage.voluntary_switches = data.ru_nvcsw;
+	usage.involuntary_switches = data.ru_nivcsw;
+	usage.lock_wait = thread_lock_wait;
+}
+
+/*
+	Adds to total what the thread used between the two snapshots.
+*/
+static void add_usage(thread_usage & total, const thread_usage & start, const thread_usage & now) {
+	// Snapshots of different threads might go backwards
+	auto delta = [](uint64_t now, uint64_t start) {
+		return now > start ? now - start : 0;
+	};
+	total.minor_faults += delta(now.minor_faults, start.minor_faults);
+	total.major_faults += delta(now.major_faults, start.major_faults);
+	total.cpu_time += delta(now.cpu_time, start.cpu_time);
+	total.user_time += delta(now.user_time, start.user_time);
+	total.system_time += delta(now.system_time, start.system_time);
+	total.voluntary_switches += delta(now.voluntary_switches, start.voluntary_switches);
+	total.involuntary_switches += delta(now.involuntary_switches, start.involuntary_switches);
+	total.lock_wait += delta(now.lock_wait, start.lock_wait);
+}
+
+void set_live_metrics(bool enabled) {
+	live_metrics_p = enabled;
+}
 
-int custom_mutex_init(custom_mutex * mutex, const pthread_mutexattr_t * attr) {
+static int metrics_bucket(uint64_t value) {
+	if (value < METRICS_SUB_BUCKETS) {
+		return value;
+	}
+	// The top 4 bits of the value, 1xxx, select the sub-bucket
+	int log = 63 - __builtin_clzll(value);
+	int sub = (value >> (log - 3)) & (METRICS_SUB_BUCKETS - 1);
+	return (log - 2) * METRICS_SUB_BUCKETS + sub;
+}
+
+/*
+	Highest value that falls in the bucket.
+*/
+static uint64_t metrics_bucket_limit(int bucket) {
+	if (bucket < METRICS_SUB_BUCKETS) {
+		return bucket;
+	}
+	int log = bucket / METRICS_SUB_BUCKETS + 2;
+	uint64_t sub = bucket % METRICS_SUB_BUCKETS;
+	return ((METRICS_SUB_BUCKETS + sub + 1) << (log - 3)) - 1;
+}
+
+static void add_to_slot(metrics_slot & slot, uint64_t weight, uint64_t duration, uint64_t allocated, uint64_t lock_wait) {
+	slot.count.fetch_add(weight, memory_order_relaxed);
+	slot.total_time.fetch_add(weight * duration, memory_order_relaxed);
+	slot.allocated.fetch_add(weight * allocated, memory_order_relaxed);
+	slot.lock_wait.fetch_add(weight * lock_wait, memory_order_relaxed);
+	slot.histogram[metrics_bucket(duration)].fetch_add(weight, memory_order_relaxed);
+	uint64_t max_time = slot.max_time.load(memory_order_relaxed);
+	while (duration > max_time && !slot.max_time.compare_exchange_weak(max_time, duration, memory_order_relaxed));
+}
+
+/*
+	Adds a finished span to the aggregates of its function,
+	since startup and in the slot of the current time.
+*/
+static void update_live_metrics(const span & s, uint64_t duration, uint64_t allocated, uint64_t lock_wait) {
+	if (s.func_id >= METRICS_MAX_FUNCTIONS) {
+		return;
+	}
+	func_live_metrics * metrics = live_metrics[s.func_id].load(memory_order_acquire);
+	if (!metrics) {
+		func_live_metrics * created = new func_live_metrics;
+		if (live_metrics[s.func_id].compare_exchange_strong(metrics, created, memory_order_acq_rel)) {
+			metrics = created;
+		} else {
+			delete created;
+		}
+	}
+
+	// Numbered from 1, so that 0 marks the slots never used
+	uint64_t epoch = read_steady_clock() / 1000000 / METRICS_SLOT_MS + 1;
+	metrics_slot & slot = metrics->window[epoch % METRICS_WINDOW_SLOTS];
+	uint64_t seen = slot.epoch.load(memory_order_acquire);
+	// First run in the slot since it was last used: clear it. Runs of other
+	// threads landing in between might be lost, which is fine for a live view
+	if (seen != epoch && slot.epoch.compare_exchange_strong(seen, epoch, memory_order_acq_rel)) {
+		slot.count = 0;
+		slot.total_time = 0;
+		slot.max_time = 0;
+		slot.allocated = 0;
+		slot.lock_wait = 0;
+		for (auto & bucket : slot.histogram) {
+			bucket.store(0, memory_order_relaxed);
+		}
+	}
+	add_to_slot(metrics->total, s.weight, duration, allocated, lock_wait);
+	add_to_slot(slot, s.weight, duration, allocated, lock_wait);
+}
+
+vector<func_metrics> get_live_metrics(uint32_t window_ms) {
+	busy_scope busy;
+	vector<string> names;
+	{
+		lock_guard<mutex> lock(func_guard);
+		names = func_names;
+	}
+	uint64_t epoch = read_steady_clock() / 1000000 / METRICS_SLOT_MS + 1;
+	uint64_t num_slots = min((uint64_t)METRICS_WINDOW_SLOTS, ((uint64_t)window_ms + METRICS_SLOT_MS - 1) / METRICS_SLOT_MS);
+
+	vector<func_metrics> result;
+	for (size_t id = 0; id < names.size() && id < METRICS_MAX_FUNCTIONS; ++id) {
+		func_live_metrics * metrics = live_metrics[id].load(memory_order_acquire);
+		if (!metrics) {
+			continue;
+		}
+
+		// Sum the slots of the window, the current one included
+		vector<const metrics_slot *> slots;
+		if (window_ms == 0) {
+			slots.push_back(&metrics->total);
+		}
+		for (uint64_t e = epoch; e > 0 && e + num_slots > epoch; --e) {
+			const metrics_slot & slot = metrics->window[e % METRICS_WINDOW_SLOTS];
+			if (slot.epoch.load(memory_order_acquire) == e) {
+				slots.push_back(&slot);
+			}
+		}
+
+		func_metrics m;
+		m.name = names[id];
+		uint64_t total_time = 0;
+		vector<uint64_t> histogram(METRICS_BUCKETS);
+		for (const metrics_slot * slot : slots) {
+			m.count += slot->count.load(memory_order_relaxed);
+			total_time += slot->total_time.load(memory_order_relaxed);
+			m.max = max(m.max, slot->max_time.load(memory_order_relaxed));
+			m.allocated += slot->allocated.load(memory_order_relaxed);
+			m.lock_wait += slot->lock_wait.load(memory_order_relaxed);
+			for (int b = 0; b < METRICS_BUCKETS; ++b) {
+				histogram[b] += slot->histogram[b].load(memory_order_relaxed);
+			}
+		}
+		if (m.count == 0) {
+			continue;
+		}
+
+		m.mean = total_time / m.count;
+		// The histogram might be slightly behind the count
+		uint64_t seen = 0, counted = accumulate(histogram.begin(), histogram.end(), (uint64_t)0);
+		for (int b = 0; b < METRICS_BUCKETS; ++b) {
+			seen += histogram[b];
+			if (m.p50 == 0 && seen * 2 >= counted) {
+				m.p50 = min(metrics_bucket_limit(b), m.max);
+			}
+			if (seen * 100 >= counted * 99) {
+				m.p99 = min(metrics_bucket_limit(b), m.max);
+				break;
+			}
+		}
+		result.push_back(m);
+	}
+	return result;
+}
+
+void set_perf_counters(bool enabled) {
+	perf_counters_p = enabled;
+}
+
+/*
+	Opens the counters of the calling thread, the first
+	one accepted by the kernel leading the group.
+*/
+static void open_perf_group(perf_group & group) {
+	group.opened = true;
+#ifdef HAS_PERF_EVENTS
+	static const pair<uint32_t, uint64_t> types[PERF_NUM_COUNTERS] = {
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+		{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+		{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+		{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+		{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS}
+	};
+	for (int i = 0; i < PERF_NUM_COUNTERS; ++i) {
+		perf_event_attr attr = {};
+		attr.size = sizeof(attr);
+		attr.type = types[i].first;
+		attr.config = types[i].second;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.exclude_hv = 1;
+		// Context switches happen in the kernel, so only leave
+		// it out if perf_event_paranoid requires it
+		int fd = syscall(SYS_perf_event_open, &attr, 0, -1, group.leader, 0);
+		if (fd < 0 && errno == EACCES) {
+			attr.exclude_kernel = 1;
+			fd = syscall(SYS_perf_event_open, &attr, 0, -1, group.leader, 0);
+		}
+		if (fd < 0) {
+			continue;
+		}
+		if (group.leader < 0) {
+			group.leader = fd;
+		}
+		group.fds[i] = fd;
+		group.index[i] = group.num_counted++;
+	}
+#endif
+}
+
+/*
+	Reads all the counters of the group at once, and notes which
+	kinds were counted. Returns false if none could be opened.
+*/
+static bool read_perf_group(const perf_group & group, span_counters & out) {
+	// nr, time enabled, time running, then the values
+	uint64_t data[3 + PERF_NUM_COUNTERS];
+	ssize_t size = (3 + group.num_counted) * sizeof(uint64_t);
+	if (group.leader < 0 || read(group.leader, data, size) != size) {
+		return false;
+	}
+	out.time_enabled = data[1];
+	out.time_running = data[2];
+	for (int i = 0; i < PERF_NUM_COUNTERS; ++i) {
+		out.values[i] = group.index[i] >= 0 ? data[3 + group.index[i]] : 0;
+		if (group.index[i] >= 0) {
+			(i < PERF_NUM_HW_COUNTERS ? out.hw_counted : out.sw_counted) = true;
+		}
+	}
+	return true;
+}
+
+/*
+	Adds to deltas how much the counters of the thread went up
+	between the two readings.
+*/
+static void add_counter_deltas(const span_counters & start, const span_counters & now, 
+ uint64_t (&deltas)[PERF_NUM_COUNTERS]) {
+	uint64_t enabled = now.time_enabled - start.time_enabled;
+	uint64_t running = now.time_running - start.time_running;
+	for (int i = 0; i < PERF_NUM_COUNTERS; ++i) {
+		uint64_t delta = now.values[i] - start.values[i];
+		// Estimate the whole span if the counters were multiplexed
+		if (running > 0 && running < enabled) {
+			delta = (uint64_t)((unsigned __int128)delta * enabled / running);
+		}
+		deltas[i] += delta;
+	}
+}
+
+/*
+	Logs how much the counters went up during the span,
+	as PERF_HW and/or PERF_SW events: since it was last attached
+	to the thread if it is, plus what it carried.
+*/
+static void record_counters(const span & s, bool attached) {
+	uint64_t deltas[PERF_NUM_COUNTERS];
+	copy(begin(s.counters->carried), end(s.counters->carried), deltas);
+	bool any_read = any_of(begin(deltas), end(deltas), [](uint64_t d) { return d > 0; });
+	span_counters now;
+	if (attached && s.counters->counting && read_perf_group(local_perf, now)) {
+		add_counter_deltas(*s.counters, now, deltas);
+		any_read = true;
+	}
+	if (!any_read) {
+		return;
+	}
+
+	if (s.counters->hw_counted) {
+		record_event(s, PERF_HW, 0, deltas[0], deltas[1], deltas[2], deltas[3]);
+	}
+	if (s.counters->sw_counted) {
+		record_event(s, PERF_SW, 0, deltas[4], deltas[5], deltas[6]);
+	}
+}
+
+int custom_mutex_init(custom_mutex * mutex, const pthread_mutexattr_t * attr, 
+ const char * name, const char * file, int line) {
+	busy_scope busy;
+	if (instrum_compiled(locks_category)) {
+		auto stats = make_unique<lock_stats>();
+		if (name) {
+			stats->name = name;
+		} else {
+			ostringstream address;
+			address << "mutex@" << (void *)mutex->mutex;
+			stats->name = address.str();
+		}
+		stats->site = string(file) + ":" + to_string(line);
+		mutex->stats = stats.get();
+		{
+			lock_guard<std::mutex> lock(lock_stats_guard);
+			lock_stats_list.push_back(move(stats));
+		}
+		// The flusher writes the stats, even if no span is ever started
+		start_flusher();
+	}
 	return pthread_mutex_init(mutex->mutex, attr);
 }
 
-uint32_t getNextUid(string func_name) {
-	lock_guard<mutex> lock(uid_guard);
-	return ++uid_list[func_name];
+/*
+	Adds value to a counter of the lock stats.
+	Only called by the holder of the mutex.
+*/
+static void bump_stat(atomic<uint64_t> & counter, uint64_t value = 1) {
+	counter.store(counter.load(memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+/*
+	Index of the histogram bucket of a time in ns.
+*/
+static int histogram_bucket(uint64_t ns) {
+	return ns ? min(63 - __builtin_clzll(ns), LOCK_HISTOGRAM_BUCKETS - 1) : 0;
+}
+
+/*
+	Adds an acquisition of the mutex to its stats.
+	Called with the mutex held.
+*/
+static void count_acquisition(custom_mutex * mutex, bool contended, uint64_t wait_time) {
+	if (lock_stats * stats = mutex->stats) {
+		bump_stat(stats->acquisitions);
+		if (contended) {
+			bump_stat(stats->contended);
+			bump_stat(stats->wait_time, wait_time);
+			bump_stat(stats->wait_histogram[histogram_bucket(wait_time)]);
+		}
+	}
+}
+
+/*
+	Adds the time the mutex was held for to its stats.
+	Called right before releasing it.
+*/
+static void count_hold(custom_mutex * mutex, uint64_t hold_time) {
+	if (lock_stats * stats = mutex->stats) {
+		bump_stat(stats->hold_time, hold_time);
+		bump_stat(stats->hold_histogram[histogram_bucket(hold_time)]);
+	}
+}
+
+/*
+	Formats the non-empty buckets of a histogram,
+	e.g. [1024,2048):5 for 5 times between 1024 and 2047 ns.
+*/
+static string format_histogram(const atomic<uint64_t> * histogram) {
+	string out;
+	for (int i = 0; i < LOCK_HISTOGRAM_BUCKETS; ++i) {
+		uint64_t count = histogram[i].load(memory_order_relaxed);
+		if (count == 0) {
+			continue;
+		}
+		out += " [" + to_string(i == 0 ? 0 : (uint64_t)1 << i) + ",";
+		out += i == LOCK_HISTOGRAM_BUCKETS - 1 ? string("inf") : to_string((uint64_t)1 << (i + 1));
+		out += "):" + to_string(count);
+	}
+	return out;
+}
+
+void dump_lock_stats() {
+	busy_scope busy;
+	lock_guard<mutex> lock(lock_stats_guard);
+	if (lock_stats_list.empty()) {
+		return;
+	}
+
+	// The side is not known until the first span starts
+	int side = side_p.load();
+	if (side < 0) {
+		return;
+	}
+
+	ofstream stats_file(side == server ? SERVER_LOCKSTATS : CLIENT_LOCKSTATS, ofstream::app);
+	if (!stats_file.is_open()) {
+		cerr << "Error: cannot open lock stats" << endl;
+		return;
+	}
+
+	// Counts are cumulative, times in ns
+	stats_file << "# lock stats at " << read_clock() << " base=" << log_time_base << '\n';
+	for (const auto & stats : lock_stats_list) {
+		stats_file << stats->name << " (" << stats->site << ") acquisitions " << stats->acquisitions.load() 
+			<< " contended " << stats->contended.load() << " wait " << stats->wait_time.load() 
+			<< " hold " << stats->hold_time.load() << '\n';
+		stats_file << "\twait" << format_histogram(stats->wait_histogram) << '\n';
+		stats_file << "\thold" << format_histogram(stats->hold_histogram) << '\n';
+	}
+}
+
+void instrum_write_log(const span & s, const string & msg) {
+	busy_scope busy;
+	// Store known events typed, so that they can be encoded in binary
+	vector<string> tokens;
+	size_t start = 0, pos;
+	while ((pos = msg.find(' ', start)) != string::npos) {
+		tokens.push_back(msg.substr(start, pos - start));
+		start = pos + 1;
+	}
+	tokens.push_back(msg.substr(start));
+
+	event_type type;
+	if (parse_event_name(tokens[0], type) && !event_has_text(type) && 
+	 tokens.size() == (size_t)event_nargs(type) + 1) {
+		uint64_t args[4] = {0, 0, 0, 0};
+		bool numeric = true;
+		for (size_t i = 1; i < tokens.size(); ++i) {
+			numeric = numeric && !tokens[i].empty() && 
+				tokens[i].find_first_not_of("0123456789") == string::npos;
+			if (numeric) {
+				args[i - 1] = stoull(tokens[i]);
+			}
+		}
+		if (numeric) {
+			record_event(s, type, 0, args[0], args[1], args[2], args[3]);
+			return;
+		}
+	}
+
+	record_event(s, USER_EVENT, 0, 0, 0, 0, 0, 0, msg);
 }
 
-void write_log(string func_name, string msg) {
-	lock_guard<mutex> lock(log_guard);
-	// Get current relative timestamp
-	const auto now = chrono::steady_clock::now();
-	const auto start_time = start_times[func_name];
-	size_t timestamp = chrono::duration_cast<chrono::TIMER_PRECISION>(now - start_time).count();
+void instrum_write_event(const span & s, event_type type, uint64_t arg0, uint64_t arg1, uint64_t arg2) {
+	busy_scope busy;
+	record_event(s, type, 0, arg0, arg1, arg2);
+}
 
-	log_buffer.push_back(to_string(timestamp) + " " + func_name + " " + msg);
+void instrum_write_foreign_event(const span & s, event_type type, uint64_t arg0, uint64_t arg1, uint64_t arg2) {
+	busy_scope busy;
+	if (any_of(span_stack.begin(), span_stack.end(), [&](const span & attached) { return attached.id == s.id; })) {
+		record_event(s, type, 0, arg0, arg1, arg2);
+		return;
+	}
+	if (!s.foreign) {
+		return;
+	}
+	log_event event = make_event(s, type, 0, arg0, arg1, arg2);
+	lock_guard<mutex> lock(s.foreign->guard);
+	if (!s.foreign->finished) {
+		s.foreign->events.push_back(move(event));
+	}
+}
+
+/*
+	Returns the shard of the allocation table holding ptr.
+*/
+static alloc_shard & get_alloc_shard(void * ptr) {
+	// The low bits are the same for all blocks because of alignment
+	uint64_t key = ((uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15ULL;
+	return alloc_table[(key >> 32) & (ALLOC_TABLE_SHARDS - 1)];
 }
 
-void* custom_malloc(string func_name, size_t size) {
+static void track_alloc(void * ptr, size_t size) {
+	alloc_shard & shard = get_alloc_shard(ptr);
+	lock_guard<mutex> lock(shard.guard);
+	if (shard.sizes.insert_or_assign(ptr, size).second) {
+		tracked_allocs.fetch_add(1, memory_order_relaxed);
+	}
+}
+
+/*
+	Forgets the block and returns its size,
+	or 0 if it was not allocated by us.
+*/
+static size_t untrack_alloc(void * ptr) {
+	alloc_shard & shard = get_alloc_shard(ptr);
+	lock_guard<mutex> lock(shard.guard);
+	auto it = shard.sizes.find(ptr);
+	if (it == shard.sizes.end()) {
+		return 0;
+	}
+	size_t size = it->second;
+	shard.sizes.erase(it);
+	tracked_allocs.fetch_sub(1, memory_order_relaxed);
+	return size;
+}
+
+/*
+	Adds the bytes allocated and freed to the span
+	and updates its peak of live bytes.
+*/
+static void account_memory(const span & s, uint64_t allocated, uint64_t freed) {
+	if (!s.memory) {
+		return;
+	}
+	s.memory->allocated.fetch_add(allocated, memory_order_relaxed);
+	s.memory->freed.fetch_add(freed, memory_order_relaxed);
+	int64_t live = s.memory->live.fetch_add(allocated - freed, memory_order_relaxed) + allocated - freed;
+	int64_t peak = s.memory->peak.load(memory_order_relaxed);
+	while (live > peak && !s.memory->peak.compare_exchange_weak(peak, live, memory_order_relaxed));
+}
+
+void* instrum_malloc(const span & s, size_t size) {
+	busy_scope busy;
 	void* ptr = malloc(size);
 	if (!ptr) {
-		handle_error("cannot allocate memory");
+		return nullptr;
 	}
-	write_log(func_name, "malloc " + to_string(size));
+	track_alloc(ptr, size);
+	account_memory(s, size, 0);
+	record_event(s, MALLOC, 0, size);
 	return ptr;
 }
 
-void* custom_realloc(string func_name, void * ptr, size_t size) {
+void* instrum_calloc(const span & s, size_t num, size_t size) {
+	busy_scope busy;
+	void* ptr = calloc(num, size);
+	if (!ptr) {
+		return nullptr;
+	}
+	track_alloc(ptr, num * size);
+	account_memory(s, num * size, 0);
+	record_event(s, MALLOC, 0, num * size);
+	return ptr;
+}
+
+void* instrum_realloc(const span & s, void * ptr, size_t size) {
+	busy_scope busy;
 	void* new_ptr;
 	// If ptr is a null pointer, the realloc function behaves 
 	// like the malloc function for the specified size
 	if (!ptr) {
-		new_ptr = custom_malloc(func_name, size);
+		new_ptr = instrum_malloc(s, size);
 	} else {
+		size_t old_size = untrack_alloc(ptr);
 		new_ptr = realloc(ptr, size);
-		write_log(func_name, "realloc " + to_string(size));
+		if (new_ptr) {
+			track_alloc(new_ptr, size);
+			account_memory(s, size, old_size);
+			record_event(s, REALLOC, 0, size, old_size);
+		} else if (old_size > 0) {
+			// The block is left as it was, and so is errno
+			int error = errno;
+			track_alloc(ptr, old_size);
+			errno = error;
+		}
 	}
-	
-	if (!new_ptr) {
-		handle_error("cannot reallocate memory");
-	}	
 	return new_ptr;
 }
 
-void custom_free(string func_name, void* ptr) {
+void instrum_free(const span & s, void* ptr) {
+	busy_scope busy;
 	if (!ptr) {
 		handle_error("cannot free memory");
 	}
-	write_log(func_name, "free");
+	size_t size = untrack_alloc(ptr);
+	account_memory(s, 0, size);
+	record_event(s, FREE, 0, size);
 	free(ptr);
 }
 
-int custom_pthread_mutex_lock(string func_name, custom_mutex* mutex) {
-	auto wait_start_time = chrono::steady_clock::now();
-	int result = pthread_mutex_lock(mutex->mutex);
+void instrum_forget_alloc(void * ptr) {
+	if (tracked_allocs.load(memory_order_relaxed) > 0) {
+		busy_scope busy;
+		untrack_alloc(ptr);
+	}
+}
+
+int instrum_mutex_lock(const span & s, custom_mutex* mutex) {
+	busy_scope busy;
+	uint64_t wait_start_time = read_clock();
+	// Try first, to tell contended acquisitions apart
+	bool contended = false;
+	int result = pthread_mutex_trylock(mutex->mutex);
+	if (result == EBUSY) {
+		contended = true;
+		result = pthread_mutex_lock(mutex->mutex);
+	}
 	if (result == 0) {
-		auto now = chrono::steady_clock::now();
+		uint64_t now = read_clock();
 		mutex->hold_start_time = now;
-		size_t wait_time = chrono::duration_cast<chrono::TIMER_PRECISION>(now - wait_start_time).count();
-		write_log(func_name, "mutex_lock " + to_string(wait_time));
+		uint64_t wait_time = now - wait_start_time;
+		count_acquisition(mutex, contended, wait_time);
+		thread_lock_wait += wait_time;
+		record_event(s, MUTEX_LOCK, 0, wait_time);
 	}
 	return result;
 }
 
-int custom_pthread_mutex_trylock(string func_name, custom_mutex* mutex) {
+int instrum_mutex_trylock(const span & s, custom_mutex* mutex) {
+	busy_scope busy;
 	int result = pthread_mutex_trylock(mutex->mutex);
 	if (result == 0) {
-		auto now = chrono::steady_clock::now();
-		mutex->hold_start_time = now;
-		write_log(func_name, "mutex_trylock");
+		mutex->hold_start_time = read_clock();
+		count_acquisition(mutex, false, 0);
+		record_event(s, MUTEX_TRYLOCK);
 	}
 	return result;
 }
 
-int custom_pthread_mutex_unlock(string func_name, custom_mutex* mutex) {
+int instrum_mutex_unlock(const span & s, custom_mutex* mutex) {
+	busy_scope busy;
+	uint64_t hold_time = read_clock() - mutex->hold_start_time;
+	count_hold(mutex, hold_time);
 	int result = pthread_mutex_unlock(mutex->mutex);
 	if (result == 0) {
-		auto now = chrono::steady_clock::now();
-		size_t hold_time = chrono::duration_cast<chrono::TIMER_PRECISION>(now - mutex->hold_start_time).count();
-		write_log(func_name, "mutex_unlock " + to_string(hold_time));
+		record_event(s, MUTEX_UNLOCK, 0, hold_time);
 	}	
 	return result;
 }
 
-int custom_pthread_cond_wait(string func_name, pthread_cond_t* cond, custom_mutex* mutex) {
+int instrum_cond_wait(const span & s, pthread_cond_t* cond, custom_mutex* mutex) {
+	busy_scope busy;
 	// Unlocks mutex (->update holding time), waits on cond (-> add waiting time),
 	// then relocks mutex and returns
-	auto start = chrono::steady_clock::now();
-	size_t hold_time = chrono::duration_cast<chrono::TIMER_PRECISION>(start - mutex->hold_start_time).count();
-	write_log(func_name, "mutex_unlock " + to_string(hold_time) + " [cond_wait]");
+	uint64_t start = read_clock();
+	uint64_t hold_time = start - mutex->hold_start_time;
+	count_hold(mutex, hold_time);
+	record_event(s, MUTEX_UNLOCK, UNLOCK_COND_WAIT, hold_time);
 
 	int result = pthread_cond_wait(cond, mutex->mutex);
-	auto now = chrono::steady_clock::now();
-	size_t wait_time = chrono::duration_cast<chrono::TIMER_PRECISION>(start - now).count();
+	uint64_t now = read_clock();
+	uint64_t wait_time = now - start;
 	mutex->hold_start_time = now;
-	write_log(func_name, "cond_wait_returned " + to_string(wait_time));
+	// Waiting for the condition is not contention
+	count_acquisition(mutex, false, 0);
+	thread_lock_wait += wait_time;
+	record_event(s, COND_WAIT_RETURNED, 0, wait_time);
 	return result;
 }
 
-int custom_pthread_cond_timedwait(string func_name, pthread_cond_t* cond, 
+int instrum_cond_timedwait(const span & s, pthread_cond_t* cond, 
  custom_mutex* mutex, const timespec* abstime) {
+	busy_scope busy;
 	// Unlocks mutex (->update holding time), waits on cond until abstime
 	// (-> add waiting time) then relocks mutex and returns
-	auto start = chrono::steady_clock::now();
-	size_t hold_time = chrono::duration_cast<chrono::TIMER_PRECISION>(start - mutex->hold_start_time).count();
-	write_log(func_name, "mutex_unlock " + to_string(hold_time) + " [cond_timedwait]");
+	uint64_t start = read_clock();
+	uint64_t hold_time = start - mutex->hold_start_time;
+	count_hold(mutex, hold_time);
+	record_event(s, MUTEX_UNLOCK, UNLOCK_COND_TIMEDWAIT, hold_time);
 
 	int result = pthread_cond_timedwait(cond, mutex->mutex, abstime);
-	auto now = chrono::steady_clock::now();
-	size_t wait_time = chrono::duration_cast<chrono::TIMER_PRECISION>(start - now).count();
+	uint64_t now = read_clock();
+	uint64_t wait_time = now - start;
 	mutex->hold_start_time = now;
-	write_log(func_name, "cond_timedwait_returned " + to_string(wait_time));
+	count_acquisition(mutex, false, 0);
+	thread_lock_wait += wait_time;
+	record_event(s, COND_TIMEDWAIT_RETURNED, 0, wait_time);
 	return result;
 }
 
-void start_instrum(string func_name, Side side, 
- const vector<feature*> & feature_list) {
-	start_times[func_name] = chrono::steady_clock::now();
-	side_p = side;
+/*
+	Helper function to get the id of a span or RPC,
+	unique among the processes, from its local one.
+*/
+static uint64_t global_id(uint32_t id) {
+	return (uint64_t)process_tag << 32 | id;
+}
+
+span instrum_start(const char * func_name, Side side, 
+ const vector<feature*> & feature_list, const trace_context & context, uint32_t weight) {
+	busy_scope busy;
+	span s;
+	s.weight = weight;
+	{
+		lock_guard<mutex> lock(func_guard);
+		auto it = func_ids.find(func_name);
+		if (it == func_ids.end()) {
+			it = func_ids.emplace(func_name, func_names.size()).first;
+			func_names.push_back(func_name);
+			func_uids.push_back(0);
+		}
+		s.func_id = it->second;
+		s.uid = ++func_uids[s.func_id];
+	}
+	s.id = ++next_span_id;
+	s.rpc_id = context.rpc_id;
+	s.parent_id = span_stack.empty() ? 0 : span_stack.back().id;
+	// The trace of the caller, else of the parent, else a new one
+	if (context.trace_id) {
+		s.trace_id = context.trace_id;
+	} else {
+		s.trace_id = span_stack.empty() ? global_id(s.id) : span_stack.back().trace_id;
+	}
+	if (instrum_enabled<memory_category>()) {
+		s.memory = make_shared<span_memory>();
+	}
+	int unset = -1;
+	side_p.compare_exchange_strong(unset, side);
+	start_flusher();
+
+	string text;
+	for (size_t i = 0; i < feature_list.size(); ++i) {
+		if (i > 0) {
+			text += " ";
+		}
+		text += feature_list[i]->print();
+	}
+
+	// Before the usage and the counters, so that what they count
+	// happened within the span
+	s.start_time = read_clock();
+	read_thread_usage(s.usage);
+	if (perf_counters_p.load(memory_order_relaxed)) {
+		if (!local_perf.opened) {
+			open_perf_group(local_perf);
+		}
+		s.counters = make_shared<span_counters>();
+		if (!read_perf_group(local_perf, *s.counters)) {
+			s.counters.reset();
+		}
+	}
+	record_event(s, FUNC_START, 0, s.func_id, s.uid, s.rpc_id + 1, weight, s.parent_id, text);
+	if (context.parent_id) {
+		record_event(s, TRACE, 0, s.trace_id, context.parent_id);
+	}
+	span_stack.push_back(s);
+	return s;
+}
+
+int64_t new_rpc_id() {
+	return global_id(++next_span_id);
+}
 
-	string msg = "FUNC_START";
-	for (auto f : feature_list) {
-		msg += " ";
-		msg += f->print();
+trace_context instrum_start_rpc(span & s) {
+	busy_scope busy;
+	// Only spans making RPCs may get events from other threads,
+	// so only they pay for keeping them
+	if (!s.foreign) {
+		s.foreign = make_shared<span_foreign>();
+		for (span & attached : span_stack) {
+			if (attached.id == s.id) {
+				attached.foreign = s.foreign;
+			}
+		}
+	}
+	trace_context context;
+	context.rpc_id = new_rpc_id();
+	if (s.id) {
+		context.trace_id = s.trace_id;
+		context.parent_id = global_id(s.id);
+		context.weight = s.weight;
 	}
+	record_event(s, RPC_START);
+	return context;
+}
 
-	write_log(func_name, msg);
+string format_trace_context(const trace_context & context) {
+	char buf[80];
+	snprintf(buf, sizeof(buf), "%" PRIx64 "-%" PRIx64 "-%" PRIx64 "-%" PRIx32, 
+		context.trace_id, context.parent_id, (uint64_t)context.rpc_id, context.weight);
+	return buf;
 }
 
-void finish_instrum(string func_name) {	
-	rusage data;
-	// RUSAGE_THREAD is not defined on darwin, so we fallback on SELF for portability.
-	// Process stats like pagefaults will be off, but at least we get _something_
-	#ifdef RUSAGE_THREAD
-		getrusage(RUSAGE_THREAD, &data);
-	#else
-		getrusage(RUSAGE_SELF, &data);
-	#endif
-	write_log(func_name, "pagefault " + to_string(data.ru_minflt) + " " + to_string(data.ru_majflt));
-	write_log(func_name, "FUNC_END");
-	dump_log();
+bool parse_trace_context(const string & value, trace_context & context) {
+	uint64_t trace_id, parent_id, rpc_id;
+	uint32_t weight;
+	int end = 0;
+	if (sscanf(value.c_str(), "%" SCNx64 "-%" SCNx64 "-%" SCNx64 "-%" SCNx32 "%n", 
+		&trace_id, &parent_id, &rpc_id, &weight, &end) != 4 || end != (int)value.size() || (int64_t)rpc_id < 0) {
+		return false;
+	}
+	context.trace_id = trace_id;
+	context.parent_id = parent_id;
+	context.rpc_id = rpc_id;
+	context.weight = weight;
+	context.remote = true;
+	return true;
+}
+
+span current_span() {
+	return span_stack.empty() ? span() : span_stack.back();
+}
+
+const span * instrum_active_span(Instrum_category category) {
+	if (instrum_busy || span_stack.empty() || !instrum_categories[category].load(memory_order_relaxed)) {
+		return nullptr;
+	}
+	return &span_stack.back();
+}
+
+/*
+	Removes the span from the spans of the thread, moving its
+	copy there to detached, which may have started RPCs since
+	the caller copied it. Returns false if it was not attached.
+*/
+static bool detach_span(uint32_t id, span & detached) {
+	// Usually the innermost one, unless spans overlap without nesting
+	for (auto it = span_stack.rbegin(); it != span_stack.rend(); ++it) {
+		if (it->id == id) {
+			detached = move(*it);
+			span_stack.erase(next(it).base());
+			return true;
+		}
+	}
+	return false;
+}
+
+void instrum_finish(const span & s) {
+	busy_scope busy;
+	// A span finished by another thread than the one it is
+	// attached to only reports what it carried from suspensions
+	span detached;
+	bool attached = detach_span(s.id, detached);
+	const shared_ptr<span_foreign> & foreign = s.foreign ? s.foreign : detached.foreign;
+	// First, so that the rest of this function is not counted
+	if (s.counters) {
+		record_counters(s, attached);
+	}
+	thread_usage used = s.carried_usage;
+	if (attached) {
+		thread_usage usage;
+		read_thread_usage(usage);
+		add_usage(used, s.usage, usage);
+	}
+	// After the usage, which then never exceeds the duration
+	uint64_t duration = read_clock() - s.start_time;
+	// No event can be logged from other threads after these
+	if (foreign) {
+		vector<log_event> events;
+		{
+			lock_guard<mutex> lock(foreign->guard);
+			foreign->finished = true;
+			events.swap(foreign->events);
+		}
+		for (log_event & event : events) {
+			push_event(event);
+		}
+	}
+	uint64_t allocated = 0;
+	if (s.memory) {
+		allocated = s.memory->allocated.load();
+		int64_t live = s.memory->live.load();
+		record_event(s, MEMORY, 0, s.memory->allocated.load(), s.memory->freed.load(), 
+			max(live, (int64_t)0), max(s.memory->peak.load(), (int64_t)0));
+	}
+	record_event(s, PAGEFAULT, 0, used.minor_faults, used.major_faults);
+	record_event(s, CPU_TIME, 0, used.cpu_time, used.user_time, used.system_time);
+	record_event(s, CONTEXT_SWITCHES, 0, used.voluntary_switches, used.involuntary_switches);
+	if (live_metrics_p.load(memory_order_relaxed)) {
+		update_live_metrics(s, duration, allocated, used.lock_wait);
+	}
+	record_event(s, FUNC_END);
+}
+
+void instrum_suspend(span & s) {
+	busy_scope busy;
+	span detached;
+	if (!detach_span(s.id, detached)) {
+		return;
+	}
+	if (!s.foreign) {
+		s.foreign = detached.foreign;
+	}
+	if (s.counters && s.counters->counting) {
+		span_counters now;
+		if (read_perf_group(local_perf, now)) {
+			add_counter_deltas(*s.counters, now, s.counters->carried);
+		}
+		s.counters->counting = false;
+	}
+	thread_usage usage;
+	read_thread_usage(usage);
+	add_usage(s.carried_usage, s.usage, usage);
+	s.suspended_ring = get_local_ring();
+}
+
+void instrum_resume(span & s) {
+	busy_scope busy;
+	// The rings are drained one after the other, so the events the span
+	// logs here could otherwise reach the log before the ones it logged
+	// on the other thread, its start included
+	if (s.suspended_ring && s.suspended_ring != local_ring.ring) {
+		lock_guard<mutex> lock(dump_guard);
+		drain_func_names();
+		lock_guard<mutex> rings_lock(ring_guard);
+		// Unless the thread exited and its ring was drained already
+		if (any_of(log_rings.begin(), log_rings.end(), [&](const auto & ring) { return ring.get() == s.suspended_ring; })) {
+			drain_ring(s.suspended_ring);
+		}
+	}
+	s.suspended_ring = nullptr;
+	read_thread_usage(s.usage);
+	if (s.counters) {
+		if (!local_perf.opened) {
+			open_perf_group(local_perf);
+		}
+		s.counters->counting = read_perf_group(local_perf, *s.counters);
+	}
+	span_stack.push_back(s);
+}
+
+/*
+	Renders the function names not defined yet in the log, so that the
+	spans drained next can refer to them. Called under dump_guard.
+*/
+static void drain_func_names() {
+	// Batches were dropped: start a new capture, so that the reader
+	// expects records of unknown spans, and define the names again
+	if (resync_log.exchange(false)) {
+		render_header(drain_buffer, LOG_FLAG_LOSSY);
+		flushed_func_names.clear();
+	}
+	lock_guard<mutex> lock(func_guard);
+	for (size_t id = flushed_func_names.size(); id < func_names.size(); ++id) {
+		flushed_func_names.push_back(func_names[id]);
+		if (log_format_p == binary_format) {
+			log_event event = {};
+			event.type = FUNC_NAME;
+			event.args[0] = id;
+			event.text = func_names[id];
+			render_binary(event, drain_buffer);
+		}
+	}
+}
+
+/*
+	Renders the events buffered in the ring. Called under dump_guard.
+*/
+static void drain_ring(log_ring * ring) {
+	size_t tail = ring->tail.load(memory_order_relaxed);
+	size_t head = ring->head.load(memory_order_acquire);
+	events_drained += head - tail;
+	for (; tail != head; ++tail) {
+		log_event & event = ring->events[tail & (LOG_RING_SIZE - 1)];
+		if (log_format_p == binary_format) {
+			render_binary(event, drain_buffer);
+		} else {
+			render_text(event, drain_buffer);
+		}
+		event.text.clear();
+	}
+	ring->tail.store(tail, memory_order_release);
 }
 
 void dump_log() {
-	lock_guard<mutex> lock(dump_guard);
-	//TODO move this to a separate shceduled thread
-	// Append instead of overwrite
-	if (side_p == server) {
-		log_p.open(SERVER_LOGFILE, ofstream::app);
-	} else if (side_p == client) {
-		log_p.open(CLIENT_LOGFILE, ofstream::app);
-	} else {
+	busy_scope busy;
+	unique_lock<mutex> lock(dump_guard);
+	drain_func_names();
+	{
+		lock_guard<mutex> lock(ring_guard);
+		for (auto it = log_rings.begin(); it != log_rings.end();) {
+			log_ring * ring = it->get();
+			// Check before draining, so that lines written right
+			// before the thread exited are not lost
+			bool retired = ring->retired.load(memory_order_acquire);
+			drain_ring(ring);
+
+			if (retired) {
+				it = log_rings.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	// Hand the drained batch over, so that the next drain
+	// does not have to wait for the disk
+	unique_lock<mutex> write_lock(write_guard);
+	swap(drain_buffer, write_buffer);
+	lock.unlock();
+
+	if (write_buffer.empty()) {
+		return;
+	}
+
+	int side = side_p.load();
+	if (side != server && side != client) {
 		cerr << "Error: incorrect side parameter" << endl;
-        exit(EXIT_FAILURE);
+		quick_exit(EXIT_FAILURE);
 	}
 
-	if (!log_p.is_open()) {
-        cerr << "Error: cannot open log" << endl;
-        exit(EXIT_FAILURE);
-    }
+	if (log_sink_p == segment_sink) {
+		write_segment(side, write_buffer);
+		write_buffer.clear();
+		return;
+	}
+
+	// The log is opened once and kept open until exit
+	if (!log_p.is_open() && !shm_ring) {
+		string header;
+		render_header(header, 0);
+		if (log_sink_p == shm_sink) {
+			open_shm_ring(side == server ? SERVER_SHM : CLIENT_SHM);
+			write_shm_ring(header);
+		} else {
+			bool binary = log_format_p == binary_format;
+			// Append instead of overwrite
+			if (side == server) {
+				log_p.open(binary ? SERVER_BINLOG : SERVER_LOGFILE, ofstream::app | ofstream::binary);
+			} else {
+				log_p.open(binary ? CLIENT_BINLOG : CLIENT_LOGFILE, ofstream::app | ofstream::binary);
+			}
 
-	for (auto s : log_buffer) {
-		log_p << s << endl;
+			// quick_exit skips the atexit flush, which would fail the same way
+			if (!log_p.is_open()) {
+				cerr << "Error: cannot open log" << endl;
+				quick_exit(EXIT_FAILURE);
+			}
+			log_p << header;
+		}
 	}
 
-	log_buffer.clear();
-	log_p.close();
+	if (shm_ring) {
+		write_shm_ring(write_buffer);
+		write_buffer.clear();
+		return;
+	}
+
+	log_p.write(write_buffer.data(), write_buffer.size());
+	log_p.flush();
+	write_buffer.clear();
 }
 
 void handle_error(string msg, int error_code) {
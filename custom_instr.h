@@ -25,18 +25,108 @@
 #include <sstream>
 #include <vector>
 #include <chrono>
+#include <atomic>
+#include <memory>
+#include <type_traits>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "log_format.h"
 
 #define SERVER_LOGFILE "server_log.txt"
 #define CLIENT_LOGFILE "client_log.txt"
+#define SERVER_BINLOG  "server_log.bin"
+#define CLIENT_BINLOG  "client_log.bin"
+#define SERVER_LOCKSTATS "server_lock_stats.txt"
+#define CLIENT_LOCKSTATS "client_lock_stats.txt"
 #define TRACE_LOGFILE  "trace_log.txt"
 #define MERGED_LOGFILE "merged_log.txt"
 
-// Must be in std::chrono
-#define TIMER_PRECISION milliseconds
-#define TIMER_UNIT "ms"
+// Unit of the timestamps in the log, and clock used to take them.
+// The TSC clock is faster to read but needs a calibration at startup
+#define TIME_UNIT unit_ns
+#define CLOCK_SOURCE steady_clock_source
+#define TSC_CALIBRATION_MS 20
+
+// Number of log lines each thread can buffer before
+// forcing a dump. Must be a power of two
+#define LOG_RING_SIZE 4096
+
+// Defaults for the background flusher: how often it wakes up
+// and how many buffered lines in a thread trigger an early flush
+#define FLUSH_INTERVAL_MS 100
+#define FLUSH_THRESHOLD 1024
+
+// Head-based sampling of the spans, see set_sampling.
+// The parameter is N for sample_every_n, the probability for
+// sample_probability and the events per second for sample_adaptive
+#define SAMPLING_MODE sample_all
+#define SAMPLING_PARAM 1
+// Lowest probability the adaptive sampling can go down to
+#define MIN_SAMPLING_PROBABILITY 0.0001
+
+// Number of shards of the table that keeps the size of the
+// blocks allocated by custom_malloc. Must be a power of two
+#define ALLOC_TABLE_SHARDS 64
+
+// How often the flusher appends the contention stats of the
+// custom mutexes to the lock stats file, and the number of buckets
+// of their histograms: bucket i counts times in [2^i, 2^(i+1)) ns
+#define LOCK_STATS_INTERVAL_MS 10000
+#define LOCK_HISTOGRAM_BUCKETS 32
+
+// Whether the spans read performance counters, see set_perf_counters
+#define PERF_COUNTERS false
+
+// Live per-function aggregates, see set_live_metrics. Sliding windows
+// go back up to METRICS_WINDOW_SLOTS slots of METRICS_SLOT_MS each.
+// Functions interned after the first METRICS_MAX_FUNCTIONS are left out
+#define LIVE_METRICS false
+#define METRICS_SLOT_MS 1000
+#define METRICS_WINDOW_SLOTS 60
+#define METRICS_MAX_FUNCTIONS 256
+
+// Format of the logs written by the instrumentation.
+// Text is meant for debugging, binary is smaller and cheaper
+#define LOG_FORMAT binary_format
+
+// Where the logs go: a file, or a shared-memory ring drained
+// by jung_collector (see set_log_sink), of SHM_RING_SIZE bytes
+#define LOG_SINK file_sink
+#define SERVER_SHM "/jung_server_log"
+#define CLIENT_SHM "/jung_client_log"
+#define SHM_RING_SIZE (16 << 20)
+// With segment_sink, the log is split into preallocated files of
+// SEGMENT_SIZE bytes in a directory, and a new one is started at
+// least every SEGMENT_DURATION_S seconds (0 for no time limit)
+#define SERVER_SEGDIR "server_log.d"
+#define CLIENT_SEGDIR "client_log.d"
+#define SEGMENT_SIZE (64 << 20)
+#define SEGMENT_DURATION_S 3600
+
+// Instrumentation levels: each one adds a category to the previous one.
+// Categories left out compile down to the plain malloc/pthread calls.
+// Override with e.g. make INSTRUM_LEVEL=INSTRUM_SPANS
+#define INSTRUM_OFF 0
+#define INSTRUM_SPANS 1
+#define INSTRUM_MEMORY 2
+#define INSTRUM_ALL 3
+
+#ifndef INSTRUM_LEVEL
+#define INSTRUM_LEVEL INSTRUM_ALL
+#endif
 
 enum Side { client, server };
 
+// Enabled from INSTRUM_SPANS, INSTRUM_MEMORY and INSTRUM_ALL respectively
+enum Instrum_category { spans_category, memory_category, locks_category, NUM_CATEGORIES };
+
+enum Log_format { text_format, binary_format };
+
+enum Log_sink { file_sink, shm_sink, segment_sink };
+
+enum Sampling_mode { sample_all, sample_every_n, sample_probability, sample_adaptive };
+
 struct feature {    
 	std::string name;
 	std::string type;
@@ -44,6 +134,7 @@ struct feature {
 
     feature(const std::string & n, const std::string & t, const std::string & v)
 	: name(n), type(t), value(v) {};
+	virtual ~feature() = default;
 
 	// Format: e.g. asd=int&12
     virtual std::string print() const {
@@ -57,101 +148,666 @@ inline feature * make_feature(const std::string & n, const std::string & t, cons
     return new feature(n, t, v);
 }
 
+// Contention stats of a custom mutex, see custom_mutex_init
+struct lock_stats;
+
 struct custom_mutex {
-	std::chrono::time_point<std::chrono::steady_clock> hold_start_time;
+	// See read_clock
+	uint64_t hold_start_time;
 	pthread_mutex_t* mutex;
+	// Set by custom_mutex_init
+	lock_stats* stats = nullptr;
+};
+
+// Memory accounting of a span, see instrum_finish
+struct span_memory;
+struct span_counters;
+struct span_foreign;
+struct log_ring;
+
+/*
+	Resource usage of a thread so far, see getrusage.
+*/
+struct thread_usage {
+	uint64_t minor_faults = 0;
+	uint64_t major_faults = 0;
+	// In ns: on the thread CPU clock, then split
+	// into user and system time by getrusage
+	uint64_t cpu_time = 0;
+	uint64_t user_time = 0;
+	uint64_t system_time = 0;
+	uint64_t voluntary_switches = 0;
+	uint64_t involuntary_switches = 0;
+	// In ns, spent waiting in the custom mutex and cond functions
+	uint64_t lock_wait = 0;
+};
+
+/*
+	Aggregates of the runs of a function that finished within
+	a time window, see get_live_metrics. Times are in ns.
+*/
+struct func_metrics {
+	std::string name;
+	// Estimated from the sampled runs (see set_sampling)
+	uint64_t count = 0;
+	uint64_t mean = 0;
+	uint64_t p50 = 0;
+	uint64_t p99 = 0;
+	uint64_t max = 0;
+	// Only counted if the memory and locks categories are enabled
+	uint64_t allocated = 0;
+	uint64_t lock_wait = 0;
+};
+
+// gRPC metadata key of the trace context, see format_trace_context
+#define TRACE_METADATA_KEY "jung-trace"
+
+/*
+	Context of an RPC, sent by the calling span along with it so
+	that the span serving it joins the same trace, see start_rpc.
+	Ids are global: unique across all the processes.
+*/
+struct trace_context {
+	// Global id of the root span of the trace
+	uint64_t trace_id = 0;
+	// Global id of the calling span, 0 if it is not recorded
+	uint64_t parent_id = 0;
+	// Logged by the caller as RPC_end <rpc_id>, and as the RPC id of the serving span
+	int64_t rpc_id = -1;
+	// Number of runs the caller stands for, 0 if it is not recorded
+	uint32_t weight = 0;
+	// Received from the caller, whose sampling decision is followed
+	bool remote = false;
+};
+
+/*
+	Handle to an instrumented function run, returned by
+	start_instrum and passed to all the logging functions.
+*/
+struct span {
+	// Unique among the spans of the process
+	uint32_t id = 0;
+	// Interned function name
+	uint32_t func_id = 0;
+	// Run number of the function (e.g. 12 for do_stuff12)
+	uint32_t uid = 0;
+	// Id of the RPC served by the span, server side only
+	int64_t rpc_id = -1;
+	// Shared by all the spans of a trace, across processes
+	uint64_t trace_id = 0;
+	// See read_clock
+	uint64_t start_time = 0;
+	// Number of runs the span stands for, 1 unless sampled
+	uint32_t weight = 1;
+	// Innermost span of the thread when this one started, 0 if none
+	uint32_t parent_id = 0;
+	// Only set if the memory category is enabled. Shared by the
+	// copies of the span, which may outlive the one that finishes it
+	std::shared_ptr<span_memory> memory;
+	// Only set if the performance counters are enabled
+	std::shared_ptr<span_counters> counters;
+	// Events logged from other threads, see write_foreign_event.
+	// Only set once the span started an RPC, see start_rpc
+	std::shared_ptr<span_foreign> foreign;
+	// Of the thread when the span started (or was resumed), so that
+	// each span reports its own faults, CPU time and context switches
+	thread_usage usage;
+	// Used on the threads the span was suspended from, see suspend_instrum
+	thread_usage carried_usage;
+	// Log buffer of the thread it was last suspended from
+	log_ring * suspended_ring = nullptr;
 };
 
 extern std::ofstream log_p;
 
 /*
-	Initializes our custom mutex struct.
+	Initializes our custom mutex struct, and starts aggregating
+	its contention stats: acquisitions, how many had to wait (and
+	a histogram of how long) and a histogram of the hold times,
+	also for the spans that are not recorded. They are written to the
+	lock stats file every LOCK_STATS_INTERVAL_MS, under the given
+	name (the address of the mutex by default) and creation site.
+*/
+extern int custom_mutex_init(custom_mutex *, const pthread_mutexattr_t *, const char * name = nullptr, 
+ const char * file = __builtin_FILE(), int line = __builtin_LINE());
+
+/*
+	Returns the current time of the instrumentation clock,
+	in ns since the time base recorded in the log header.
+*/
+extern uint64_t read_clock();
+
+/* 
+	Prints the given error message, dumps the log to
+	the disk and exits returning a failure code.
+*/
+extern void handle_error(std::string msg, int error_code = EXIT_FAILURE);
+
+/*
+	Implementations behind the wrappers below, which should
+	be used instead: they skip these calls when the category
+	is disabled or the span is not being recorded (unless
+	the mutex keeps contention stats, for the lock functions).
+	The allocation functions return null, logging nothing,
+	when the allocation fails, like the ones of libc.
+*/
+extern void instrum_write_log(const span & s, const std::string & msg);
+extern void instrum_write_event(const span & s, event_type type, uint64_t arg0, uint64_t arg1, uint64_t arg2);
+extern void instrum_write_foreign_event(const span & s, event_type type, uint64_t arg0, uint64_t arg1, uint64_t arg2);
+extern void* instrum_malloc(const span & s, size_t size);
+extern void* instrum_calloc(const span & s, size_t num, size_t size);
+extern void* instrum_realloc(const span & s, void* ptr, size_t size);
+extern void instrum_free(const span & s, void* ptr);
+extern int instrum_mutex_lock(const span & s, struct custom_mutex* mutex);
+extern int instrum_mutex_trylock(const span & s, struct custom_mutex* mutex);
+extern int instrum_mutex_unlock(const span & s, struct custom_mutex* mutex);
+extern int instrum_cond_wait(const span & s, pthread_cond_t* cond, struct custom_mutex* mutex);
+extern int instrum_cond_timedwait(const span & s, pthread_cond_t* cond, 
+	struct custom_mutex* mutex, const struct timespec* abstime);
+extern span instrum_start(const char * func_name, Side side, 
+ const std::vector<feature*> & feature_list, const trace_context & context, uint32_t weight);
+extern trace_context instrum_start_rpc(span & s);
+
+/*
+	Decides whether the run being started is recorded.
+	Returns 0 if it is not, otherwise the number of runs
+	it stands for. See set_sampling.
+*/
+extern uint32_t instrum_sample();
+extern void instrum_finish(const span & s);
+extern void instrum_suspend(span & s);
+extern void instrum_resume(span & s);
+
+/*
+	Returns the innermost open span of the calling thread if the
+	calls of the category it makes should be logged, or null if
+	there is none, the category is disabled or the thread is
+	running the instrumentation itself (whose own allocations and
+	locks are not logged). Used by libjung_preload to attribute
+	the calls it intercepts, see jung_preload.cc.
+*/
+extern const span * instrum_active_span(Instrum_category category);
+
+/*
+	Forgets the block if it was allocated by the custom functions.
+	Used by libjung_preload for the blocks freed outside of a span,
+	which would otherwise stay in the table of allocation sizes.
+*/
+extern void instrum_forget_alloc(void * ptr);
+
+/*
+	Returns the innermost span started by the calling thread
+	and not finished yet, or a span that is not recorded.
+	Spans started while another one is open are nested in it.
+	It is a copy, which stays valid as spans start and finish.
+*/
+extern span current_span();
+
+/*
+	Runtime switches of the instrumentation categories,
+	all enabled by default. See set_instrum_category.
 */
-extern int custom_mutex_init(custom_mutex *, const pthread_mutexattr_t *);
+extern std::atomic<bool> instrum_categories[NUM_CATEGORIES];
 
 /*
-	Thread-safely returns a new unique id (uid) for a function.
+	Enables or disables a category of instrumentation at runtime.
+	Categories left out by INSTRUM_LEVEL stay disabled.
 */
-extern uint32_t getNextUid(std::string func_name);
+extern void set_instrum_category(Instrum_category category, bool enabled);
+
+/*
+	Enables the performance counters of the spans (PERF_COUNTERS
+	by default), read with perf_event_open when a span starts and
+	ends: cycles, instructions, cache and branch misses where the
+	hardware allows (PERF_HW event), and the task clock in ns,
+	context switches and CPU migrations of the thread (PERF_SW).
+	Without a PMU, e.g. in most VMs, only the latter are counted.
+	Linux only, elsewhere nothing is logged.
+*/
+extern void set_perf_counters(bool enabled);
+
+/*
+	Enables the live aggregates of the spans (LIVE_METRICS by
+	default): each finished span adds its duration to a latency
+	histogram of its function, along with the bytes it allocated
+	and the time it waited for locks, both in total and in a ring
+	of METRICS_SLOT_MS slots. Meant to be polled while the process
+	runs, e.g. by the JungMetrics service of jung_server.
+*/
+extern void set_live_metrics(bool enabled);
+
+/*
+	Returns the aggregates of every function with finished spans:
+	over the last window_ms (rounded up to whole slots, at most
+	METRICS_WINDOW_SLOTS of them), or since startup if 0.
+	Percentiles are accurate to 1/8 of their power of two.
+*/
+extern std::vector<func_metrics> get_live_metrics(uint32_t window_ms);
+
+/*
+	Returns a new global RPC id, e.g. for a server to serve
+	an RPC whose caller sent no trace context.
+*/
+extern int64_t new_rpc_id();
+
+/*
+	Encodes the context as the value of its metadata,
+	its ids in hex: trace-parent-rpc-weight.
+*/
+extern std::string format_trace_context(const trace_context & context);
+
+/*
+	Decodes the metadata sent by format_trace_context into context,
+	marking it as remote. Returns false if it is malformed.
+*/
+extern bool parse_trace_context(const std::string & value, trace_context & context);
+
+/*
+	Whether the category is compiled in by INSTRUM_LEVEL.
+*/
+constexpr bool instrum_compiled(Instrum_category category) {
+	return INSTRUM_LEVEL > category;
+}
+
+/*
+	Whether the category is both compiled in and enabled.
+	Compiles to false if the category is left out.
+*/
+template <Instrum_category category>
+inline bool instrum_enabled() {
+	if constexpr (instrum_compiled(category)) {
+		return instrum_categories[category].load(std::memory_order_relaxed);
+	} else {
+		return false;
+	}
+}
 
 /*
 	Writes the given string to the log file.
 	Output format:  time_elapsed function_name event [params]
-	Example: 150 do_stuff RPC_start
-	Example: 152 do_stuff malloc 10
+	where time_elapsed is relative to the start of the span
+	(or to the time base of the log for FUNC_START).
+	Example: 150 do_stuff1 RPC_start
+	Example: 152 do_stuff1 malloc 10
+*/
+inline void write_log(const span & s, const std::string & msg) {
+	if (instrum_enabled<spans_category>() && s.id) {
+		instrum_write_log(s, msg);
+	}
+}
+
+/*
+	Writes an event of the given type to the log.
+	Cheaper than write_log, since no message has to be built.
+	Example: write_event(s, RPC_END, context.rpc_id)
+*/
+inline void write_event(const span & s, event_type type, 
+ uint64_t arg0 = 0, uint64_t arg1 = 0, uint64_t arg2 = 0) {
+	if (instrum_enabled<spans_category>() && s.id) {
+		instrum_write_event(s, type, arg0, arg1, arg2);
+	}
+}
+
+/*
+	Writes an event to the log like write_event, from any thread,
+	e.g. the one completing an asynchronous RPC made by the span.
+	Unless the span is attached to the calling thread, the event
+	is kept until the span finishes, so that it reaches the log
+	before its end, and dropped if the span has finished already
+	or s is a copy made before the span started an RPC.
 */
-extern void write_log(std::string func_name, std::string msg);
+inline void write_foreign_event(const span & s, event_type type, 
+ uint64_t arg0 = 0, uint64_t arg1 = 0, uint64_t arg2 = 0) {
+	if (instrum_enabled<spans_category>() && s.id) {
+		instrum_write_foreign_event(s, type, arg0, arg1, arg2);
+	}
+}
 
 /*
 	A custom malloc implementation that writes to the log
-	how much memory has been allocated.
+	how much memory has been allocated, and remembers the
+	size of the block for custom_realloc and custom_free.
 */
-extern void* custom_malloc(std::string func_name, size_t size);
+inline void* custom_malloc(const span & s, size_t size) {
+	if (instrum_enabled<memory_category>() && s.id) {
+		void* new_ptr = instrum_malloc(s, size);
+		if (!new_ptr) {
+			handle_error("cannot allocate memory");
+		}
+		return new_ptr;
+	}
+	return malloc(size);
+}
+
+/*
+	A custom calloc implementation that writes to the log
+	how much memory has been allocated, like custom_malloc.
+*/
+inline void* custom_calloc(const span & s, size_t num, size_t size) {
+	if (instrum_enabled<memory_category>() && s.id) {
+		void* new_ptr = instrum_calloc(s, num, size);
+		if (!new_ptr) {
+			handle_error("cannot allocate memory");
+		}
+		return new_ptr;
+	}
+	return calloc(num, size);
+}
 
 /*
 	A custom realloc implementation that writes to the log
-	how much memory has been reallocated (if any).
-	Note: logging might be unreliable or imprecise.
+	the new size of the block and the previous one.
 */
-extern void* custom_realloc(std::string func_name, void* ptr, size_t size);
+inline void* custom_realloc(const span & s, void* ptr, size_t size) {
+	if (instrum_enabled<memory_category>() && s.id) {
+		void* new_ptr = instrum_realloc(s, ptr, size);
+		if (!new_ptr) {
+			handle_error("cannot reallocate memory");
+		}
+		return new_ptr;
+	}
+	if constexpr (instrum_compiled(memory_category)) {
+		if (ptr) {
+			instrum_forget_alloc(ptr);
+		}
+	}
+	return realloc(ptr, size);
+}
 
 /*
 	A custom free implementation that writes to the log
-	if memory has been freed.
+	how much memory has been freed (0 if the block
+	was not allocated by the custom functions).
 */
-extern void custom_free(std::string func_name, void* ptr);
+inline void custom_free(const span & s, void* ptr) {
+	if (instrum_enabled<memory_category>() && s.id) {
+		instrum_free(s, ptr);
+	} else {
+		// It may have been allocated in a span
+		if constexpr (instrum_compiled(memory_category)) {
+			if (ptr) {
+				instrum_forget_alloc(ptr);
+			}
+		}
+		free(ptr);
+	}
+}
 
 /*
 	A custom mutex_lock implementation that writes 
 	to the log how much time it waited for the lock.
+	Waits and hold times also go to the stats of the mutex.
 */
-extern int custom_pthread_mutex_lock(std::string func_name, struct custom_mutex* mutex);
+inline int custom_pthread_mutex_lock(const span & s, struct custom_mutex* mutex) {
+	if (instrum_enabled<locks_category>() && (s.id || mutex->stats)) {
+		return instrum_mutex_lock(s, mutex);
+	}
+	return pthread_mutex_lock(mutex->mutex);
+}
 
 /*
 	A custom mutex_trylock implementation.
 */
-extern int custom_pthread_mutex_trylock(std::string func_name, struct custom_mutex* mutex);
+inline int custom_pthread_mutex_trylock(const span & s, struct custom_mutex* mutex) {
+	if (instrum_enabled<locks_category>() && (s.id || mutex->stats)) {
+		return instrum_mutex_trylock(s, mutex);
+	}
+	return pthread_mutex_trylock(mutex->mutex);
+}
 
 /*
 	A custom mutex_unlock implementation that writes 
 	to the log how much time it held the lock.
 */
-extern int custom_pthread_mutex_unlock(std::string func_name, struct custom_mutex* mutex);
+inline int custom_pthread_mutex_unlock(const span & s, struct custom_mutex* mutex) {
+	if (instrum_enabled<locks_category>() && (s.id || mutex->stats)) {
+		return instrum_mutex_unlock(s, mutex);
+	}
+	return pthread_mutex_unlock(mutex->mutex);
+}
 
 /*
 	A custom cond_wait implementation that writes 
 	to the log how much time it waited for the condition.
 */
-extern int custom_pthread_cond_wait(std::string func_name, pthread_cond_t* cond, struct custom_mutex* mutex);
+inline int custom_pthread_cond_wait(const span & s, pthread_cond_t* cond, struct custom_mutex* mutex) {
+	if (instrum_enabled<locks_category>() && (s.id || mutex->stats)) {
+		return instrum_cond_wait(s, cond, mutex);
+	}
+	return pthread_cond_wait(cond, mutex->mutex);
+}
 
 /*
 	A custom cond_timedwait implementation that writes 
 	to the log how much time it waited for the condition.
 */
-extern int custom_pthread_cond_timedwait(std::string func_name, pthread_cond_t* cond, 
-	struct custom_mutex* mutex, const struct timespec* abstime);
+inline int custom_pthread_cond_timedwait(const span & s, pthread_cond_t* cond, 
+ struct custom_mutex* mutex, const struct timespec* abstime) {
+	if (instrum_enabled<locks_category>() && (s.id || mutex->stats)) {
+		return instrum_cond_timedwait(s, cond, mutex, abstime);
+	}
+	return pthread_cond_timedwait(cond, mutex->mutex, abstime);
+}
 
 /*
-	Starts our custom instrumentation.
-	Side is either server or client.
+	Starts our custom instrumentation of a run of func_name
+	and returns its span. Side is either server or client,
+	the same for all the spans of the process.
+	On the server side, rpc_id is the id sent back to the client.
+	If spans are disabled or the run is not sampled,
+	returns a span that is not recorded.
 */
-extern void start_instrum(std::string func_name, Side side, 
- const std::vector<feature*> & feature_list);
+inline span start_instrum(const char * func_name, Side side, 
+ const std::vector<feature*> & feature_list, int64_t rpc_id = -1) {
+	if (instrum_enabled<spans_category>()) {
+		if (uint32_t weight = instrum_sample()) {
+			trace_context context;
+			context.rpc_id = rpc_id;
+			return instrum_start(func_name, side, feature_list, context, weight);
+		}
+	}
+	return span();
+}
 
 /*
-	Stops the instrumentation.
+	Same as above, for a run serving the RPC of the given context
+	(see parse_trace_context): the span joins the trace of the
+	caller, and is only recorded if the caller is. Without a
+	context received from the caller, the run is sampled as usual.
 */
-extern void finish_instrum(std::string func_name);
+inline span start_instrum(const char * func_name, Side side, 
+ const std::vector<feature*> & feature_list, const trace_context & context) {
+	if (instrum_enabled<spans_category>()) {
+		if (uint32_t weight = context.remote ? context.weight : instrum_sample()) {
+			return instrum_start(func_name, side, feature_list, context, weight);
+		}
+	}
+	return span();
+}
+
+/*
+	Same as above, but the features are only built (by calling
+	make_features) if the span is recorded, so that nothing
+	is computed when the instrumentation is disabled
+	or the run is not sampled.
+	Example: start_instrum(__func__, client, [&] { 
+	             return std::vector<feature*>{ make_feature("n", "int", std::to_string(n)) }; });
+*/
+template <typename F, typename = std::enable_if_t<std::is_invocable_v<F>>>
+inline span start_instrum(const char * func_name, Side side, F make_features, int64_t rpc_id = -1) {
+	if (instrum_enabled<spans_category>()) {
+		if (uint32_t weight = instrum_sample()) {
+			trace_context context;
+			context.rpc_id = rpc_id;
+			return instrum_start(func_name, side, make_features(), context, weight);
+		}
+	}
+	return span();
+}
+
+template <typename F, typename = std::enable_if_t<std::is_invocable_v<F>>>
+inline span start_instrum(const char * func_name, Side side, F make_features, const trace_context & context) {
+	if (instrum_enabled<spans_category>()) {
+		if (uint32_t weight = context.remote ? context.weight : instrum_sample()) {
+			return instrum_start(func_name, side, make_features(), context, weight);
+		}
+	}
+	return span();
+}
+
+/*
+	Starts an RPC made by the span: logs RPC_start and returns the
+	context to send along with it, as TRACE_METADATA_KEY metadata
+	(see format_trace_context). Its rpc_id is the one to log
+	at the end: write_event(s, RPC_END, context.rpc_id).
+	From then on, s and the span attached to the thread can
+	take events from other threads, see write_foreign_event.
+	If spans are disabled, returns a context not to be sent (rpc_id -1).
+*/
+inline trace_context start_rpc(span & s) {
+	if (instrum_enabled<spans_category>()) {
+		return instrum_start_rpc(s);
+	}
+	return trace_context();
+}
+
+/*
+	Stops the instrumentation. Logs the bytes allocated and
+	freed by the span, how many of them are still live and
+	the peak of live bytes during the span.
+*/
+inline void finish_instrum(const span & s) {
+	if (instrum_enabled<spans_category>() && s.id) {
+		instrum_finish(s);
+	}
+}
+
+/*
+	Detaches the span from the calling thread when its run goes on
+	asynchronously, e.g. waiting for a timer or another RPC on a
+	completion queue: it stops being the current span of the thread,
+	and keeps the resource usage and performance counters of the
+	thread so far. Has no effect if the span is not attached to
+	the thread. Finishing a span on a thread it is not attached to
+	only reports what it kept.
+*/
+inline void suspend_instrum(span & s) {
+	if (instrum_enabled<spans_category>() && s.id) {
+		instrum_suspend(s);
+	}
+}
+
+/*
+	Attaches a suspended span to the calling thread, which continues
+	its run and need not be the one that suspended it: the span is
+	again the current one, and counts the resources of this thread.
+*/
+inline void resume_instrum(span & s) {
+	if (instrum_enabled<spans_category>() && s.id) {
+		instrum_resume(s);
+	}
+}
+
+/*
+	Starts the instrumentation on construction and
+	stops it when going out of scope.
+	Example: instrum_scope scope(__func__, client, {});
+	         custom_malloc(scope, 10);
+*/
+struct instrum_scope {
+	span s;
+
+	template <typename F, typename = std::enable_if_t<std::is_invocable_v<F>>>
+	instrum_scope(const char * func_name, Side side, F && features, int64_t rpc_id = -1)
+	: s(start_instrum(func_name, side, std::forward<F>(features), rpc_id)) {};
+
+	instrum_scope(const char * func_name, Side side, 
+	 const std::vector<feature*> & feature_list, int64_t rpc_id = -1)
+	: s(start_instrum(func_name, side, feature_list, rpc_id)) {};
+
+	template <typename F, typename = std::enable_if_t<std::is_invocable_v<F>>>
+	instrum_scope(const char * func_name, Side side, F && features, const trace_context & context)
+	: s(start_instrum(func_name, side, std::forward<F>(features), context)) {};
+
+	instrum_scope(const char * func_name, Side side, 
+	 const std::vector<feature*> & feature_list, const trace_context & context)
+	: s(start_instrum(func_name, side, feature_list, context)) {};
+
+	~instrum_scope() {
+		finish_instrum(s);
+	}
+
+	instrum_scope(const instrum_scope &) = delete;
+	instrum_scope & operator=(const instrum_scope &) = delete;
+
+	operator const span &() const {
+		return s;
+	}
+};
 
 /* 
 	Dumps the content of the log buffer to the disk.
+	Normally called by the background flusher, but it
+	can be invoked directly to force a synchronous flush.
 */
 extern void dump_log();
 
-/* 
-	Prints the given error message, dumps the log to
-	the disk and exits returning a failure code.
+/*
+	Appends the contention stats of all the custom mutexes
+	to the lock stats file. Normally called by the flusher.
 */
-extern void handle_error(std::string msg, int error_code = EXIT_FAILURE);
+extern void dump_lock_stats();
+
+/*
+	Sets how often (in ms) the background flusher writes
+	the log, and how many lines buffered by a single thread
+	wake it up early.
+*/
+extern void set_flush_params(uint32_t interval_ms, size_t threshold);
+
+/*
+	Selects which runs are recorded (SAMPLING_MODE by default),
+	deciding once per span in start_instrum:
+	sample_all records every run, sample_every_n one run every
+	param in each thread, sample_probability each run with
+	probability param, and sample_adaptive adjusts the probability
+	so that about param events per second are logged.
+	The number of runs each span stands for is logged with it.
+*/
+extern void set_sampling(Sampling_mode mode, double param);
+
+/*
+	Selects where the log is written (LOG_SINK by default).
+	With shm_sink, the flusher copies the binary log into a
+	shared-memory ring (SERVER_SHM or CLIENT_SHM) and never touches
+	the disk: jung_collector drains it into the log file. Batches
+	that do not fit because the collector is behind are dropped,
+	and counted in the ring. With segment_sink, it goes to numbered
+	segment files in SERVER_SEGDIR or CLIENT_SEGDIR, each one
+	fallocate'd and mapped in memory, and rotated by size and age
+	(SEGMENT_SIZE, SEGMENT_DURATION_S). Must be called before the
+	first start_instrum, and both imply the binary format.
+*/
+extern void set_log_sink(Log_sink sink);
+
+/*
+	Selects the format of the log (LOG_FORMAT by default).
+	Must be called before the first start_instrum.
+*/
+extern void set_log_format(Log_format format);
+
+/*
+	Selects the unit of the timestamps in the log (TIME_UNIT
+	by default). Must be called before the first start_instrum.
+*/
+extern void set_time_unit(Time_unit unit);
+
+/*
+	Selects the clock used for the timestamps (CLOCK_SOURCE
+	by default). Must be called before the first start_instrum.
+	Returns false, keeping the steady clock, if the TSC is not
+	invariant or not available on this machine.
+*/
+extern bool set_clock_source(Clock_source source);
 
 #endif
@@ -22,17 +22,34 @@
 #include <string>
 #include <filesystem>
 #include <thread>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+#include <chrono>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
 
 #include <grpcpp/grpcpp.h>
 
 #include "jung.grpc.pb.h"
 #include "custom_instr.h"
+#include "jung_interceptors.h"
 
 #define SERVER_PORT 50051
 #define NUM_MSG 20
 #define NUM_POINTS 3
 #define NUM_THREADS 4
 #define CLEAR_LOG true
+// Latency histograms of the load generator are exact below LOAD_SUB_BUCKETS ns,
+// then split each power of two in LOAD_SUB_BUCKETS (under 1% error, like HDR
+// histograms with 2 significant digits), up to 2^64 ns
+#define LOAD_SUB_BUCKETS 128
+#define LOAD_SUB_BITS 7
+#define LOAD_BUCKETS ((64 - LOAD_SUB_BITS + 1) * LOAD_SUB_BUCKETS)
 
 using grpc::Channel;
 using grpc::ClientContext;
@@ -40,10 +57,15 @@ using grpc::Status;
 using jung::JungRequest;
 using jung::JungReply;
 using jung::Jung;
+using jung::JungMetrics;
+using jung::MetricsRequest;
+using jung::MetricsReply;
 
 using namespace std;
 
 string server_address = "localhost:" + to_string(SERVER_PORT);
+// Shared by all the calls of the test, see main
+shared_ptr<Channel> shared_channel;
 
 class JungClient {
 	public:
@@ -52,52 +74,48 @@ class JungClient {
 		// Assembles the client's payload, sends it and presents the response back
 		// from the server.
 		JungReply Greet(const string& message) {
-			// Data we are sending to the server.
-			JungRequest request;
-			request.set_message(message);
-
 			// Container for the data we expect from the server.
 			JungReply reply;
-
-			// Context for the client. It could be used to convey extra information to
-			// the server and/or tweak certain RPC behaviors.
-			ClientContext context;
-
-			// The actual RPC.
-			Status status = stub_->Greet(&context, request, &reply);
-
-			// Act upon its status.
-			if (!status.ok()) {
-				cerr << "Error #" << status.error_code() << ": " << status.error_message() << endl;
-				exit(EXIT_FAILURE);
-			}
+			check(TryGreet(message, &reply));
 			return reply;
 		}
 
 		JungReply ReturnDouble(const string& message) {
+			JungReply reply;
+			check(TryReturnDouble(message, &reply));
+			return reply;
+		}
+
+		// Same as above, but leave acting upon the status to the caller
+		Status TryGreet(const string& message, JungReply* reply) {
 			// Data we are sending to the server.
 			JungRequest request;
 			request.set_message(message);
 
-			// Container for the data we expect from the server.
-			JungReply reply;
-
 			// Context for the client. It could be used to convey extra information to
 			// the server and/or tweak certain RPC behaviors.
 			ClientContext context;
 
 			// The actual RPC.
-			Status status = stub_->ReturnDouble(&context, request, &reply);
+			return stub_->Greet(&context, request, reply);
+		}
+
+		Status TryReturnDouble(const string& message, JungReply* reply) {
+			JungRequest request;
+			request.set_message(message);
+			ClientContext context;
+			return stub_->ReturnDouble(&context, request, reply);
+		}
 
-			// Act upon its status.
+	private:
+		// Act upon the status of the RPC.
+		static void check(const Status & status) {
 			if (!status.ok()) {
 				cerr << "Error #" << status.error_code() << ": " << status.error_message() << endl;
 				exit(EXIT_FAILURE);
 			}
-			return reply;
 		}
 
-	private:
 		unique_ptr<Jung::Stub> stub_;
 };
 
@@ -106,44 +124,37 @@ class JungClient {
 	that should make the complexity scale.
 */
 void do_stuff(unsigned int param) {
-	string func_name(__func__);
-	func_name += to_string(getNextUid(func_name));
-	start_instrum(func_name, client, { make_feature("param", "int", to_string(param)), 
-										make_feature("useless", "double", to_string(12.2)) });
+	span s = start_instrum(__func__, client, [&] {
+		return vector<feature*>{ make_feature("param", "int", to_string(param)), 
+									make_feature("useless", "double", to_string(12.2)) };
+	});
 
-	JungClient jung(grpc::CreateChannel(
-		server_address, grpc::InsecureChannelCredentials()));
+	JungClient jung(shared_channel);
 
 	// Allocate some memory so we can track it
-	custom_malloc(func_name, param);
+	custom_malloc(s, param);
 
 	// Send the "ciao" messages
 	for (int i = 0; i < param; ++i) {
 		string message("mamma " + to_string(param));
-		write_log(func_name, "RPC_start");
+		// Logged on s by the interceptors, see create_instrum_channel
 		JungReply reply = jung.Greet(message);
 
 		cout << "Sent: " << message << endl;
 		cout << "Received: " << reply.message() << endl;
-
-		// Save the resulting id from the RPC call
-		write_log(func_name, "RPC_end " + to_string(reply.id()));
 	}
 
 	// Send the Double messages
 	for (int i = 0; i < param; ++i) {
 		string message(to_string(param));
-		write_log(func_name, "RPC_start");
+		// Logged on s by the interceptors, see create_instrum_channel
 		JungReply reply = jung.ReturnDouble(message);
 
 		cout << "Sent: " << message << endl;
 		cout << "Received: " << reply.message() << endl;
-
-		// Save the resulting id from the RPC call
-		write_log(func_name, "RPC_end " + to_string(reply.id()));
 	}
 
-	finish_instrum(func_name);
+	finish_instrum(s);
 }
 
 /*
@@ -151,58 +162,408 @@ void do_stuff(unsigned int param) {
 	int parameter that should make the complexity scale.
 */
 void do_multi_stuff(unsigned int param, custom_mutex * mutex) {
-	string func_name(__func__);
-	func_name += to_string(getNextUid(func_name));
-	start_instrum(func_name, client, { make_feature("param", "int", to_string(param)), 
-										make_feature("useless", "int", to_string(42069)) });
+	span s = start_instrum(__func__, client, [&] {
+		return vector<feature*>{ make_feature("param", "int", to_string(param)), 
+									make_feature("useless", "int", to_string(42069)) };
+	});
 	// Acquire lock and hold for param sec
-	custom_pthread_mutex_lock(func_name, mutex);
+	custom_pthread_mutex_lock(s, mutex);
 	cout << "T" << this_thread::get_id() << " holding for " << param << " seconds..." << endl;
 	this_thread::sleep_for(chrono::seconds(param));
 	cout << "T" << this_thread::get_id() << " releasing lock..." << endl;
-	custom_pthread_mutex_unlock(func_name, mutex);
+	custom_pthread_mutex_unlock(s, mutex);
+
+	finish_instrum(s);
+}
+
+static bool is_number(const string & s) {
+	return !s.empty() && s.find_first_not_of("0123456789") == string::npos;
+}
+
+/*
+	Parses a rate of calls per second, which can be
+	fractional but must be positive.
+*/
+static bool parse_rate(const string & s, double & rate) {
+	size_t end = 0;
+	try {
+		rate = stod(s, &end);
+	} catch (const logic_error &) {
+		return false;
+	}
+	return end == s.size() && isfinite(rate) && rate > 0;
+}
+
+/*
+	Prints the live metrics of the server over the last
+	window_ms, or since it started if 0.
+*/
+void print_metrics(uint32_t window_ms) {
+	unique_ptr<JungMetrics::Stub> stub = JungMetrics::NewStub(grpc::CreateChannel(
+		server_address, grpc::InsecureChannelCredentials()));
+	MetricsRequest request;
+	request.set_window_ms(window_ms);
+	MetricsReply reply;
+	ClientContext context;
+
+	Status status = stub->GetMetrics(&context, request, &reply);
+	if (!status.ok()) {
+		cerr << "Error #" << status.error_code() << ": " << status.error_message() << endl;
+		exit(EXIT_FAILURE);
+	}
 
-	finish_instrum(func_name);
+	cout << (window_ms > 0 ? "Last " + to_string(window_ms) + " ms" : "Since startup") << ", times in ns:" << endl;
+	for (const auto & f : reply.functions()) {
+		cout << f.name() << ": " << f.count() << " run(s), mean " << f.mean() << ", p50 " << f.p50() << 
+			", p99 " << f.p99() << ", max " << f.max() << ", allocated " << f.allocated_bytes() << 
+			" bytes, waited " << f.lock_wait() << " for locks" << endl;
+	}
+}
+
+/*
+	Latency histogram of the load generator, see LOAD_SUB_BUCKETS.
+	Each worker fills its own, merged at the end.
+*/
+struct latency_histogram {
+	vector<uint64_t> buckets = vector<uint64_t>(LOAD_BUCKETS);
+	uint64_t count = 0;
+	uint64_t total = 0;
+	uint64_t max = 0;
+
+	static int bucket(uint64_t value) {
+		if (value < LOAD_SUB_BUCKETS) {
+			return value;
+		}
+		// The top LOAD_SUB_BITS + 1 bits of the value, 1x..x, select the sub-bucket
+		int log = 63 - __builtin_clzll(value);
+		int sub = (value >> (log - LOAD_SUB_BITS)) & (LOAD_SUB_BUCKETS - 1);
+		return (log - LOAD_SUB_BITS + 1) * LOAD_SUB_BUCKETS + sub;
+	}
+
+	// Highest value that falls in the bucket
+	static uint64_t bucket_limit(int bucket) {
+		if (bucket < LOAD_SUB_BUCKETS) {
+			return bucket;
+		}
+		int log = bucket / LOAD_SUB_BUCKETS + LOAD_SUB_BITS - 1;
+		uint64_t sub = bucket % LOAD_SUB_BUCKETS;
+		return ((LOAD_SUB_BUCKETS + sub + 1) << (log - LOAD_SUB_BITS)) - 1;
+	}
+
+	void record(uint64_t ns) {
+		++buckets[bucket(ns)];
+		++count;
+		total += ns;
+		max = std::max(max, ns);
+	}
+
+	void merge(const latency_histogram & other) {
+		for (int b = 0; b < LOAD_BUCKETS; ++b) {
+			buckets[b] += other.buckets[b];
+		}
+		count += other.count;
+		total += other.total;
+		max = std::max(max, other.max);
+	}
+
+	// p in [0, 100]
+	uint64_t percentile(double p) const {
+		uint64_t rank = (uint64_t)(p / 100 * count + 0.5);
+		uint64_t seen = 0;
+		for (int b = 0; b < LOAD_BUCKETS; ++b) {
+			seen += buckets[b];
+			if (seen >= std::max((uint64_t)1, rank)) {
+				return std::min(bucket_limit(b), max);
+			}
+		}
+		return max;
+	}
+};
+
+enum load_method { load_greet, load_return_double, NUM_LOAD_METHODS };
+
+const char * load_method_names[NUM_LOAD_METHODS] = { "Greet", "ReturnDouble" };
+// Names of the spans of the calls, so that the interceptors log them
+const char * load_span_names[NUM_LOAD_METHODS] = { "load_Greet", "load_ReturnDouble" };
+
+struct load_options {
+	// Closed loop: each worker sends a call as soon as the previous one
+	// returns. Open loop: the calls arrive at qps on average, as a Poisson
+	// process, whether the previous ones returned or not
+	bool open_loop = false;
+	uint32_t duration_s = 10;
+	uint32_t workers = NUM_THREADS;
+	double qps = 100;
+	uint32_t channels = 1;
+	vector<load_method> methods = { load_greet };
+};
+
+/*
+	Results of a worker, per method.
+*/
+struct load_results {
+	latency_histogram latencies[NUM_LOAD_METHODS];
+	uint64_t failed[NUM_LOAD_METHODS] = {};
+};
+
+/*
+	Arrival times of the calls of an open-loop test,
+	scheduled by the main thread and sent by the workers.
+*/
+struct load_queue {
+	mutex guard;
+	condition_variable cv;
+	deque<pair<chrono::steady_clock::time_point, load_method>> calls;
+	bool closed = false;
+
+	void push(chrono::steady_clock::time_point arrival, load_method method) {
+		{
+			lock_guard<mutex> lock(guard);
+			calls.emplace_back(arrival, method);
+		}
+		cv.notify_one();
+	}
+
+	void close() {
+		{
+			lock_guard<mutex> lock(guard);
+			closed = true;
+		}
+		cv.notify_all();
+	}
+
+	// Returns false once closed and empty
+	bool pop(chrono::steady_clock::time_point & arrival, load_method & method) {
+		unique_lock<mutex> lock(guard);
+		cv.wait(lock, [this] { return closed || !calls.empty(); });
+		if (calls.empty()) {
+			return false;
+		}
+		tie(arrival, method) = calls.front();
+		calls.pop_front();
+		return true;
+	}
+};
+
+/*
+	Sends one call of the load test in its own span,
+	and records how long it took since it was due.
+*/
+void send_load_call(JungClient & jung, load_method method, chrono::steady_clock::time_point due, 
+ load_results & results) {
+	span s = start_instrum(load_span_names[method], client, vector<feature*>());
+	JungReply reply;
+	// ReturnDouble 0 mostly returns right away, see the server
+	Status status = method == load_greet ? jung.TryGreet("load", &reply) : jung.TryReturnDouble("0", &reply);
+	uint64_t latency = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - due).count();
+	finish_instrum(s);
+
+	if (status.ok()) {
+		results.latencies[method].record(latency);
+	} else {
+		++results.failed[method];
+	}
+}
+
+void print_load_line(const char * name, const latency_histogram & latencies, uint64_t failed, double seconds) {
+	cout << name << ": " << latencies.count << " call(s), " << failed << " failed, " << 
+		(uint64_t)(latencies.count / seconds) << "/s";
+	if (latencies.count > 0) {
+		cout << ", latency in ns: mean " << latencies.total / latencies.count << ", p50 " << latencies.percentile(50) << 
+			", p90 " << latencies.percentile(90) << ", p99 " << latencies.percentile(99) << ", p99.9 " << 
+			latencies.percentile(99.9) << ", max " << latencies.max;
+	}
+	cout << endl;
+}
+
+/*
+	Loads the server with calls of the given methods, picked at random,
+	for the given duration, then prints the throughput and latency
+	percentiles of each method. The workers share the channels, each
+	its own connection. In open-loop mode, the latency is counted from
+	when the call was due, so that a server falling behind is not hidden
+	by the workers waiting for it (coordinated omission).
+*/
+void run_load(const load_options & options) {
+	vector<shared_ptr<Channel>> channels;
+	for (uint32_t i = 0; i < options.channels; ++i) {
+		grpc::ChannelArguments args;
+		// Otherwise channels with the same arguments share their connection
+		args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+		channels.push_back(create_instrum_channel(server_address, grpc::InsecureChannelCredentials(), args));
+	}
+
+	cout << "-> Starting " << (options.open_loop ? "open" : "closed") << "-loop load test: " << options.workers << 
+		" worker(s)";
+	if (options.open_loop) {
+		cout << ", " << options.qps << " calls/s";
+	}
+	cout << ", " << options.channels << " channel(s), " << options.duration_s << " s..." << endl;
+
+	vector<load_results> results(options.workers);
+	load_queue queue;
+	auto start = chrono::steady_clock::now();
+	auto deadline = start + chrono::seconds(options.duration_s);
+
+	vector<thread> workers;
+	for (uint32_t i = 0; i < options.workers; ++i) {
+		workers.emplace_back([&, i] {
+			JungClient jung(channels[i % channels.size()]);
+			mt19937 gen(random_device{}());
+			uniform_int_distribution<size_t> pick(0, options.methods.size() - 1);
+			chrono::steady_clock::time_point due;
+			load_method method;
+
+			if (options.open_loop) {
+				while (queue.pop(due, method)) {
+					send_load_call(jung, method, due, results[i]);
+				}
+				return;
+			}
+			while ((due = chrono::steady_clock::now()) < deadline) {
+				send_load_call(jung, options.methods[pick(gen)], due, results[i]);
+			}
+		});
+	}
+
+	if (options.open_loop) {
+		mt19937 gen(random_device{}());
+		exponential_distribution<> interval(options.qps);
+		uniform_int_distribution<size_t> pick(0, options.methods.size() - 1);
+		auto due = start;
+		while (true) {
+			due += chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(interval(gen)));
+			if (due >= deadline) {
+				break;
+			}
+			this_thread::sleep_until(due);
+			queue.push(due, options.methods[pick(gen)]);
+		}
+		queue.close();
+	}
+
+	for (auto & th : workers) {
+		th.join();
+	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	latency_histogram all;
+	uint64_t all_failed = 0;
+	for (int m = 0; m < NUM_LOAD_METHODS; ++m) {
+		latency_histogram latencies;
+		uint64_t failed = 0;
+		for (const auto & r : results) {
+			latencies.merge(r.latencies[m]);
+			failed += r.failed[m];
+		}
+		if (latencies.count > 0 || failed > 0) {
+			print_load_line(load_method_names[m], latencies, failed, seconds);
+		}
+		all.merge(latencies);
+		all_failed += failed;
+	}
+	print_load_line("Total", all, all_failed, seconds);
 }
 
 int main(int argc, char** argv) {
 	// Instantiate the client. It requires a channel, out of which the actual RPCs
 	// are created. This channel models a connection to an endpoint specified by
-	// the argument "--target=" which is the only expected argument.
+	// the argument "--target=".
 	// We indicate that the channel isn't authenticated (use of
 	// InsecureChannelCredentials()).
 	string arg_str("--target");
-
-	if (argc > 1) {
-		string arg_val = argv[1];
-		size_t start_pos = arg_val.find(arg_str);
-
-		if (start_pos != string::npos) {
-			start_pos += arg_str.size();
-
-			if (arg_val[start_pos] == '=') {
-				server_address = arg_val.substr(start_pos + 1);
-
-				// Add default port if not explicitly passed
-				if (server_address.find(":") == string::npos) {
-					server_address += ":" + to_string(SERVER_PORT);
+	// With --metrics[=window_ms], only print the live metrics of the server
+	string metrics_str("--metrics");
+	int64_t metrics_window = -1;
+	// With --load=closed|open, run a load test instead of the fixed one
+	string load_str("--load");
+	string duration_str("--duration");
+	string workers_str("--workers");
+	string qps_str("--qps");
+	string channels_str("--channels");
+	string methods_str("--methods");
+	bool load = false;
+	load_options options;
+	bool usage_error = false;
+
+	for (int i = 1; i < argc; ++i) {
+		string arg_val = argv[i];
+
+		if (arg_val.rfind(arg_str + "=", 0) == 0) {
+			server_address = arg_val.substr(arg_str.size() + 1);
+
+			// Add default port if not explicitly passed
+			if (server_address.find(":") == string::npos) {
+				server_address += ":" + to_string(SERVER_PORT);
+			}
+		} else if (arg_val == metrics_str) {
+			metrics_window = 0;
+		} else if (arg_val.rfind(metrics_str + "=", 0) == 0 && is_number(arg_val.substr(metrics_str.size() + 1))) {
+			metrics_window = stoul(arg_val.substr(metrics_str.size() + 1));
+		} else if (arg_val == load_str + "=closed" || arg_val == load_str + "=open") {
+			load = true;
+			options.open_loop = arg_val == load_str + "=open";
+		} else if (arg_val.rfind(duration_str + "=", 0) == 0 && is_number(arg_val.substr(duration_str.size() + 1))) {
+			options.duration_s = stoul(arg_val.substr(duration_str.size() + 1));
+		} else if (arg_val.rfind(workers_str + "=", 0) == 0 && is_number(arg_val.substr(workers_str.size() + 1))) {
+			options.workers = stoul(arg_val.substr(workers_str.size() + 1));
+		} else if (arg_val.rfind(qps_str + "=", 0) == 0) {
+			// Rejects zero, which would never start a call
+			if (!parse_rate(arg_val.substr(qps_str.size() + 1), options.qps)) {
+				usage_error = true;
+			}
+		} else if (arg_val.rfind(channels_str + "=", 0) == 0 && is_number(arg_val.substr(channels_str.size() + 1))) {
+			options.channels = stoul(arg_val.substr(channels_str.size() + 1));
+		} else if (arg_val.rfind(methods_str + "=", 0) == 0) {
+			// Comma-separated, e.g. Greet,ReturnDouble
+			options.methods.clear();
+			stringstream names(arg_val.substr(methods_str.size() + 1));
+			string name;
+			while (getline(names, name, ',')) {
+				auto it = find(begin(load_method_names), end(load_method_names), name);
+				if (it == end(load_method_names)) {
+					usage_error = true;
+					break;
 				}
-			} else {
-				cerr << "Usage: " << argv[0] << " [--target=hostname]" << endl;
-				return EXIT_FAILURE;
+				options.methods.push_back((load_method)(it - begin(load_method_names)));
 			}
 		} else {
-			cerr << "Usage: " << argv[0] << " [--target=hostname]" << endl;
+			usage_error = true;
+		}
+
+		if (usage_error) {
+			cerr << "Usage: " << argv[0] << " [--target=hostname] [--metrics[=window_ms]]" << endl;
+			cerr << "       " << argv[0] << " [--target=hostname] --load=closed|open [--duration=s] [--workers=n] " <<
+				"[--qps=calls_per_s] [--channels=n] [--methods=Greet,ReturnDouble]" << endl;
 			return EXIT_FAILURE;
 		}
 	}
+	if (load && (options.workers == 0 || options.channels == 0 || options.methods.empty())) {
+		cerr << "Error: the workers, channels and methods of the load test cannot be zero" << endl;
+		return EXIT_FAILURE;
+	}
 
-	if (filesystem::exists(CLIENT_LOGFILE) && CLEAR_LOG) {
+	if (metrics_window >= 0) {
+		print_metrics(metrics_window);
+		return EXIT_SUCCESS;
+	}
+
+	if ((filesystem::exists(CLIENT_LOGFILE) || filesystem::exists(CLIENT_BINLOG) || 
+		filesystem::exists(CLIENT_SEGDIR)) && CLEAR_LOG) {
 		cout << "Removing previous logs..." << endl;
 		remove(CLIENT_LOGFILE);
+		remove(CLIENT_BINLOG);
+		filesystem::remove_all(CLIENT_SEGDIR);
+		remove(CLIENT_LOCKSTATS);
 	}
 
 	cout << "Connecting to " << server_address << "..." << endl;
+	shared_channel = create_instrum_channel(server_address, grpc::InsecureChannelCredentials());
+
+	if (load) {
+		run_load(options);
+		return EXIT_SUCCESS;
+	}
 
 	cout << "-> Starting RPC test..." << endl;
 	for (int i = 0; i < NUM_MSG; ++i) {
@@ -216,7 +577,7 @@ int main(int argc, char** argv) {
 	custom_mutex lock;
 	pthread_mutex_t m;
 	lock.mutex = &m;
-	custom_mutex_init(&lock, NULL);
+	custom_mutex_init(&lock, NULL, "multi_stuff_lock");
 
 	vector<thread> threads;
 	for (int i = 0; i < NUM_THREADS; ++i) {
@@ -0,0 +1,193 @@
+/*
+ *
+ * Copyright 2021 Stefano Taillefert.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+	Drains the shared-memory ring of an instrumented process
+	(see set_log_sink) into a binary log, so that the process
+	itself never writes to disk. Waits for the process to start,
+	and exits once it has exited, even if it was killed, and the
+	ring is empty.
+	Usage: ./jung_collector [--side server|client] [--output path|-]
+	With --output -, the log is written to stdout, e.g. to be sent
+	to another machine: ./jung_collector | ssh host 'cat > server_log.bin'
+*/
+
+#include <iostream>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <thread>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "custom_instr.h"
+
+using namespace std;
+
+// How long to sleep when the ring is empty
+#define POLL_INTERVAL_MS 10
+
+volatile sig_atomic_t stop_requested = 0;
+
+void handle_signal(int) {
+	stop_requested = 1;
+}
+
+/*
+	Maps the ring named name, waiting for the process to create it.
+	Returns null if interrupted before.
+*/
+shm_ring_header * attach_ring(const char * name) {
+	bool waiting = false;
+	while (!stop_requested) {
+		int fd = shm_open(name, O_RDWR, 0);
+		struct stat st;
+		// The ring is created empty, then truncated to its size
+		if (fd != -1 && fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(shm_ring_header)) {
+			void * mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			close(fd);
+			if (mem == MAP_FAILED) {
+				perror("Error mapping the ring");
+				exit(EXIT_FAILURE);
+			}
+			shm_ring_header * ring = (shm_ring_header *)mem;
+			// Not initialized yet
+			if (ring->magic[0] == '\0') {
+				munmap(mem, st.st_size);
+				this_thread::sleep_for(chrono::milliseconds(POLL_INTERVAL_MS));
+				continue;
+			}
+			atomic_thread_fence(memory_order_acquire);
+			if (strncmp(ring->magic, SHM_MAGIC, sizeof(ring->magic)) != 0 || ring->version != LOG_VERSION ||
+				sizeof(shm_ring_header) + ring->capacity != (size_t)st.st_size) {
+				cerr << "Error: " << name << " is not a ring of log version " << LOG_VERSION << endl;
+				exit(EXIT_FAILURE);
+			}
+			return ring;
+		}
+		if (fd != -1) {
+			close(fd);
+		}
+		if (!waiting) {
+			cerr << "Waiting for " << name << "..." << endl;
+			waiting = true;
+		}
+		this_thread::sleep_for(chrono::milliseconds(POLL_INTERVAL_MS));
+	}
+	return nullptr;
+}
+
+int main(int argc, char** argv) {
+	Side side = server;
+	string output;
+
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "--side" && i + 1 < argc) {
+			string value = argv[++i];
+			if (value != "server" && value != "client") {
+				cerr << "Error: unknown side " << value << endl;
+				exit(EXIT_FAILURE);
+			}
+			side = value == "server" ? server : client;
+		} else if (arg == "--output" && i + 1 < argc) {
+			output = argv[++i];
+		} else {
+			cerr << "Usage: " << argv[0] << " [--side server|client] [--output path|-]" << endl;
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (output.empty()) {
+		output = side == server ? SERVER_BINLOG : CLIENT_BINLOG;
+	}
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	const char * name = side == server ? SERVER_SHM : CLIENT_SHM;
+	shm_ring_header * ring = attach_ring(name);
+	if (!ring) {
+		return 0;
+	}
+	const char * data = (const char *)ring + sizeof(shm_ring_header);
+
+	FILE * out = output == "-" ? stdout : fopen(output.c_str(), "ab");
+	if (!out) {
+		perror("Error opening the output");
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t reported_batches = 0;
+	uint64_t total_bytes = 0;
+	while (true) {
+		// Read before head, so that nothing written before exiting is missed
+		bool closed = ring->closed.load(memory_order_acquire);
+		// A process that was killed or crashed did not close the ring
+		bool killed = !closed && kill(ring->pid, 0) != 0 && errno == ESRCH;
+		uint64_t head = ring->head.load(memory_order_acquire);
+		uint64_t tail = ring->tail.load(memory_order_relaxed);
+
+		if (head != tail) {
+			size_t offset = tail & (ring->capacity - 1);
+			size_t first = min(head - tail, ring->capacity - offset);
+			fwrite(data + offset, 1, first, out);
+			fwrite(data, 1, head - tail - first, out);
+			if (ferror(out)) {
+				perror("Error writing the output");
+				exit(EXIT_FAILURE);
+			}
+			ring->tail.store(head, memory_order_release);
+			total_bytes += head - tail;
+		}
+
+		uint64_t dropped_batches = ring->dropped_batches.load(memory_order_relaxed);
+		if (dropped_batches != reported_batches) {
+			cerr << "Warning: the process dropped " << dropped_batches << " batch(es), "
+				<< ring->dropped_bytes.load(memory_order_relaxed) << " bytes, waiting for the collector" << endl;
+			reported_batches = dropped_batches;
+		}
+
+		if (((closed || killed) && head == tail) || stop_requested) {
+			if (killed && !stop_requested) {
+				cerr << "Warning: the process exited without closing " << name << endl;
+			}
+			break;
+		}
+		if (head == tail) {
+			fflush(out);
+			this_thread::sleep_for(chrono::milliseconds(POLL_INTERVAL_MS));
+		}
+	}
+
+	fflush(out);
+	if (out != stdout) {
+		fclose(out);
+	}
+	munmap(ring, sizeof(shm_ring_header) + ring->capacity);
+	// Only remove the ring of a process that is gone
+	if (!stop_requested) {
+		shm_unlink(name);
+	}
+	cerr << "Collected " << total_bytes << " bytes from " << name << endl;
+	return 0;
+}
@@ -0,0 +1,319 @@
+/*
+ *
+ * Copyright 2021 Stefano Taillefert.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <mutex>
+#include <unordered_map>
+
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/support/client_interceptor.h>
+#include <grpcpp/support/server_interceptor.h>
+#include <google/protobuf/message.h>
+
+#include "jung_interceptors.h"
+#include "custom_instr.h"
+
+using grpc::experimental::ClientInterceptorFactoryInterface;
+using grpc::experimental::ClientRpcInfo;
+using grpc::experimental::InterceptionHookPoints;
+using grpc::experimental::Interceptor;
+using grpc::experimental::InterceptorBatchMethods;
+using grpc::experimental::ServerInterceptorFactoryInterface;
+using grpc::experimental::ServerRpcInfo;
+using google::protobuf::Descriptor;
+using google::protobuf::FieldDescriptor;
+using google::protobuf::Message;
+using google::protobuf::Reflection;
+
+using namespace std;
+
+/*
+	Returns the trace context sent by the client along with the RPC,
+	or one with just a new RPC id if it sent none (e.g. a client that
+	is not instrumented).
+*/
+static trace_context received_trace(const grpc::ServerContextBase & context) {
+	trace_context trace;
+	auto it = context.client_metadata().find(TRACE_METADATA_KEY);
+	if (it == context.client_metadata().end() ||
+		!parse_trace_context(string(it->second.data(), it->second.size()), trace)) {
+		trace.rpc_id = new_rpc_id();
+	}
+	return trace;
+}
+
+// Spans of the RPCs of asynchronous services waiting for their
+// handler, see resume_rpc_span
+mutex pending_guard;
+unordered_map<const grpc::ServerContextBase *, span> pending_spans;
+
+/*
+	Helper function to build the features of a request: its size,
+	then its top-level scalar fields. They are owned by owned.
+*/
+static vector<feature*> message_features(const Message * message, uint64_t bytes,
+ vector<unique_ptr<feature>> & owned) {
+	owned.emplace_back(make_feature("request_bytes", "long", to_string(bytes)));
+	if (message) {
+		const Descriptor * descriptor = message->GetDescriptor();
+		const Reflection * reflection = message->GetReflection();
+		string scratch;
+		for (int i = 0; i < descriptor->field_count(); ++i) {
+			const FieldDescriptor * field = descriptor->field(i);
+			if (field->is_repeated()) {
+				owned.emplace_back(make_feature(field->name() + "_size", "int",
+					to_string(reflection->FieldSize(*message, field))));
+				continue;
+			}
+			switch (field->cpp_type()) {
+				case FieldDescriptor::CPPTYPE_INT32:
+					owned.emplace_back(make_feature(field->name(), "int", to_string(reflection->GetInt32(*message, field))));
+					break;
+				// Values that may not fit an int are longs, the ones
+				// of a uint64 above the largest long are clamped to it
+				case FieldDescriptor::CPPTYPE_INT64:
+					owned.emplace_back(make_feature(field->name(), "long", to_string(reflection->GetInt64(*message, field))));
+					break;
+				case FieldDescriptor::CPPTYPE_UINT32:
+					owned.emplace_back(make_feature(field->name(), "long", to_string(reflection->GetUInt32(*message, field))));
+					break;
+				case FieldDescriptor::CPPTYPE_UINT64:
+					owned.emplace_back(make_feature(field->name(), "long", 
+						to_string(min(reflection->GetUInt64(*message, field), (uint64_t)INT64_MAX))));
+					break;
+				case FieldDescriptor::CPPTYPE_BOOL:
+					owned.emplace_back(make_feature(field->name(), "int", to_string(reflection->GetBool(*message, field))));
+					break;
+				case FieldDescriptor::CPPTYPE_ENUM:
+					owned.emplace_back(make_feature(field->name(), "int", to_string(reflection->GetEnumValue(*message, field))));
+					break;
+				case FieldDescriptor::CPPTYPE_DOUBLE:
+					owned.emplace_back(make_feature(field->name(), "double", to_string(reflection->GetDouble(*message, field))));
+					break;
+				case FieldDescriptor::CPPTYPE_FLOAT:
+					owned.emplace_back(make_feature(field->name(), "double", to_string(reflection->GetFloat(*message, field))));
+					break;
+				case FieldDescriptor::CPPTYPE_STRING:
+					owned.emplace_back(make_feature(field->name() + "_len", "int",
+						to_string(reflection->GetStringReference(*message, field, &scratch).size())));
+					break;
+				default:
+					break;
+			}
+		}
+	}
+
+	vector<feature*> features;
+	for (const auto & f : owned) {
+		features.push_back(f.get());
+	}
+	return features;
+}
+
+/*
+	Helper function to get the size of the message about to be sent.
+	It is serialized anyway, so this costs no extra work.
+*/
+static uint64_t sent_bytes(InterceptorBatchMethods * methods) {
+	grpc::ByteBuffer * buffer = methods->GetSerializedSendMessage();
+	return buffer ? buffer->Length() : 0;
+}
+
+/*
+	Runs the server span of an RPC, from the request being
+	received to the status being sent.
+*/
+class server_instrum_interceptor : public Interceptor {
+	public:
+		server_instrum_interceptor(ServerRpcInfo * info, bool async): info(info), async(async), taken_time(read_clock()) {}
+
+		~server_instrum_interceptor() {
+			if (async) {
+				lock_guard<mutex> lock(pending_guard);
+				pending_spans.erase(info->server_context());
+			}
+		}
+
+		void Intercept(InterceptorBatchMethods * methods) override {
+			if (methods->QueryInterceptionHookPoint(InterceptionHookPoints::POST_RECV_MESSAGE)) {
+				received(static_cast<const Message *>(methods->GetRecvMessage()));
+			}
+			if (s.id && methods->QueryInterceptionHookPoint(InterceptionHookPoints::PRE_SEND_MESSAGE)) {
+				response_bytes += sent_bytes(methods);
+			}
+			if (s.id && methods->QueryInterceptionHookPoint(InterceptionHookPoints::PRE_SEND_STATUS)) {
+				// An asynchronous handler may have moved the span to this thread, see resume_rpc_span
+				span current = current_span();
+				if (current.id == s.id) {
+					s = current;
+				}
+				if (async) {
+					lock_guard<mutex> lock(pending_guard);
+					pending_spans.erase(info->server_context());
+				}
+				uint64_t now = read_clock();
+				write_event(s, RPC_TIMES, s.start_time - taken_time, now - s.start_time);
+				write_event(s, RPC_STATUS, methods->GetSendStatus().error_code(), request_bytes, response_bytes);
+				finish_instrum(s);
+				s = span();
+			}
+			methods->Proceed();
+		}
+
+	private:
+		// Starts the span on the first message, right before the handler runs
+		void received(const Message * request) {
+			if (started) {
+				if (s.id && request) {
+					request_bytes += request->ByteSizeLong();
+				}
+				return;
+			}
+			started = true;
+			const char * method = info->method();
+			const char * name = strrchr(method, '/');
+			vector<unique_ptr<feature>> features;
+			s = start_instrum(name ? name + 1 : method, server, [&] {
+				request_bytes = request ? request->ByteSizeLong() : 0;
+				return message_features(request, request_bytes, features);
+			}, received_trace(*info->server_context()));
+			// The handler might run on any thread polling the completion queue
+			if (async && s.id) {
+				suspend_instrum(s);
+				lock_guard<mutex> lock(pending_guard);
+				pending_spans[info->server_context()] = s;
+			}
+		}
+
+		ServerRpcInfo * info;
+		bool async;
+		// When a server thread took the RPC, see read_clock
+		uint64_t taken_time;
+		bool started = false;
+		span s;
+		uint64_t request_bytes = 0;
+		uint64_t response_bytes = 0;
+};
+
+class server_instrum_factory : public ServerInterceptorFactoryInterface {
+	public:
+		server_instrum_factory(const vector<string> & skipped_services, const vector<string> & async_services)
+		: skipped_services(skipped_services), async_services(async_services) {}
+
+		Interceptor * CreateServerInterceptor(ServerRpcInfo * info) override {
+			// No interceptor at all costs less than one that does nothing
+			if (!instrum_enabled<spans_category>() || in_services(info->method(), skipped_services)) {
+				return nullptr;
+			}
+			return new server_instrum_interceptor(info, in_services(info->method(), async_services));
+		}
+
+	private:
+		// e.g. /jung.JungMetrics/GetMetrics for jung.JungMetrics
+		static bool in_services(const char * method, const vector<string> & services) {
+			for (const string & service : services) {
+				if (strncmp(method + 1, service.c_str(), service.size()) == 0 && method[service.size() + 1] == '/') {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		vector<string> skipped_services;
+		vector<string> async_services;
+};
+
+/*
+	Logs an RPC on the span that makes it.
+*/
+class client_instrum_interceptor : public Interceptor {
+	public:
+		explicit client_instrum_interceptor(const span & caller): s(caller), trace(start_rpc(s)) {}
+
+		void Intercept(InterceptorBatchMethods * methods) override {
+			if (methods->QueryInterceptionHookPoint(InterceptionHookPoints::PRE_SEND_INITIAL_METADATA)) {
+				methods->GetSendInitialMetadata()->emplace(TRACE_METADATA_KEY, format_trace_context(trace));
+			}
+			if (methods->QueryInterceptionHookPoint(InterceptionHookPoints::PRE_SEND_MESSAGE)) {
+				request_bytes += sent_bytes(methods);
+			}
+			if (methods->QueryInterceptionHookPoint(InterceptionHookPoints::POST_RECV_MESSAGE)) {
+				if (const Message * response = static_cast<const Message *>(methods->GetRecvMessage())) {
+					response_bytes += response->ByteSizeLong();
+				}
+			}
+			if (methods->QueryInterceptionHookPoint(InterceptionHookPoints::POST_RECV_STATUS)) {
+				// The status of an asynchronous call may come on another thread, after the span finished
+				write_foreign_event(s, RPC_END, trace.rpc_id);
+				write_foreign_event(s, RPC_STATUS, methods->GetRecvStatus()->error_code(), request_bytes, response_bytes);
+			}
+			methods->Proceed();
+		}
+
+	private:
+		span s;
+		trace_context trace;
+		uint64_t request_bytes = 0;
+		uint64_t response_bytes = 0;
+};
+
+class client_instrum_factory : public ClientInterceptorFactoryInterface {
+	public:
+		Interceptor * CreateClientInterceptor(ClientRpcInfo * info) override {
+			// Created on the thread making the call
+			span caller = current_span();
+			if (!instrum_enabled<spans_category>() || !caller.id) {
+				return nullptr;
+			}
+			return new client_instrum_interceptor(caller);
+		}
+};
+
+void add_server_instrum(grpc::ServerBuilder & builder, const vector<string> & skipped_services,
+ const vector<string> & async_services) {
+	vector<unique_ptr<ServerInterceptorFactoryInterface>> creators;
+	creators.push_back(make_unique<server_instrum_factory>(skipped_services, async_services));
+	builder.experimental().SetInterceptorCreators(move(creators));
+}
+
+span resume_rpc_span(const grpc::ServerContextBase * context) {
+	span s;
+	{
+		lock_guard<mutex> lock(pending_guard);
+		auto it = pending_spans.find(context);
+		if (it == pending_spans.end()) {
+			return s;
+		}
+		s = it->second;
+		pending_spans.erase(it);
+	}
+	resume_instrum(s);
+	return s;
+}
+
+shared_ptr<grpc::Channel> create_instrum_channel(const string & target,
+ const shared_ptr<grpc::ChannelCredentials> & credentials, const grpc::ChannelArguments & args) {
+	vector<unique_ptr<ClientInterceptorFactoryInterface>> creators;
+	creators.push_back(make_unique<client_instrum_factory>());
+	return grpc::experimental::CreateCustomChannelWithInterceptors(target, credentials,
+		args, move(creators));
+}
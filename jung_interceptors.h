@@ -0,0 +1,79 @@
+/*
+ *
+ * Copyright 2021 Stefano Taillefert.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef JUNG_INTERCEPTORS_H_INCLUDED
+#define JUNG_INTERCEPTORS_H_INCLUDED
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+
+#include "custom_instr.h"
+
+/*
+	gRPC interceptors that instrument every RPC, so that the
+	handlers and the calls need no instrumentation code.
+	The messages are assumed to be protobuf ones.
+*/
+
+/*
+	Instruments every method served by the server built by builder,
+	except the ones of skipped_services (full names, e.g.
+	jung.JungMetrics). Each RPC gets a server span named after the
+	method (e.g. Greet), which joins the trace of the client (see
+	start_rpc) and is the current span of the handler (see
+	current_span). Its features are the size of the request and its
+	top-level scalar fields (the length of strings, the size of
+	repeated fields). It logs an rpc_times event (time between taking
+	the RPC and running the handler, and time in the handler) and an
+	rpc_status one (status code, request and response bytes).
+	The handlers of async_services, served from completion queues,
+	may run on another thread than the one that received the request:
+	they get their span with resume_rpc_span instead.
+	Replaces the interceptors already set on builder, if any.
+*/
+extern void add_server_instrum(grpc::ServerBuilder & builder,
+	const std::vector<std::string> & skipped_services = {},
+	const std::vector<std::string> & async_services = {});
+
+/*
+	Attaches the span of an RPC of an asynchronous service (see
+	add_server_instrum) to the calling thread, which runs its handler,
+	and returns it. Returns an empty span if the RPC is not recorded.
+	To be called once per RPC. If the handler then goes on in another
+	step, it should suspend the span and resume it on the thread of
+	the next step, at the latest the one that sends the response (see
+	suspend_instrum).
+*/
+extern span resume_rpc_span(const grpc::ServerContextBase * context);
+
+/*
+	Creates a channel to target whose calls are instrumented: a call
+	made inside a recorded span logs RPC_start and RPC_end on it (see
+	start_rpc), along with an rpc_status event (status code, request
+	and response bytes), and sends it its trace context. Calls made
+	outside of a recorded span send none, so the server samples
+	them itself. args are passed on to the channel.
+*/
+extern std::shared_ptr<grpc::Channel> create_instrum_channel(const std::string & target,
+	const std::shared_ptr<grpc::ChannelCredentials> & credentials,
+	const grpc::ChannelArguments & args = grpc::ChannelArguments());
+
+#endif
@@ -0,0 +1,286 @@
+/*
+ *
+ * Copyright 2021 Stefano Taillefert.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+/*
+	Preloadable library that intercepts the allocation and pthread
+	mutex/cond calls of the whole program, third-party code included,
+	and logs them on the span active on the calling thread (see
+	instrum_active_span). Calls made outside of a span go straight
+	to libc.
+
+	The instrumentation itself is the one linked in the program,
+	which must be built with -rdynamic so that it can be reached
+	from here. In any other program all the calls are passed through.
+	Usage: LD_PRELOAD=./libjung_preload.so ./jung_server
+*/
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "custom_instr.h"
+
+// Locks a thread can hold at the same time and still have logged
+#define PRELOAD_MAX_HELD_LOCKS 16
+
+// Weak, so that the library also loads in programs that do not export them
+extern const span * instrum_active_span(Instrum_category category) __attribute__((weak));
+extern void* instrum_malloc(const span & s, size_t size) __attribute__((weak));
+extern void* instrum_calloc(const span & s, size_t num, size_t size) __attribute__((weak));
+extern void* instrum_realloc(const span & s, void* ptr, size_t size) __attribute__((weak));
+extern void instrum_free(const span & s, void* ptr) __attribute__((weak));
+extern void instrum_forget_alloc(void * ptr) __attribute__((weak));
+extern int instrum_mutex_lock(const span & s, struct custom_mutex* mutex) __attribute__((weak));
+extern int instrum_mutex_trylock(const span & s, struct custom_mutex* mutex) __attribute__((weak));
+extern int instrum_mutex_unlock(const span & s, struct custom_mutex* mutex) __attribute__((weak));
+extern int instrum_cond_wait(const span & s, pthread_cond_t* cond, struct custom_mutex* mutex) __attribute__((weak));
+extern int instrum_cond_timedwait(const span & s, pthread_cond_t* cond,
+	struct custom_mutex* mutex, const struct timespec* abstime) __attribute__((weak));
+
+// The allocator of glibc, which needs no dlsym (that might allocate itself)
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t num, size_t size);
+extern "C" void* __libc_realloc(void* ptr, size_t size);
+extern "C" void __libc_free(void* ptr);
+
+/*
+	A lock taken by the thread inside a span, with the time it
+	was taken: plain pthread mutexes have no room to store it.
+*/
+struct held_lock {
+	pthread_mutex_t * mutex;
+	uint64_t hold_start_time;
+};
+
+// Initial-exec TLS needs no allocation on first access, unlike the other models
+#define PRELOAD_TLS __attribute__((tls_model("initial-exec")))
+
+// Set while a call is being logged, so that the calls made
+// by the instrumentation itself go straight to libc
+static thread_local bool in_hook PRELOAD_TLS = false;
+static thread_local held_lock held_locks[PRELOAD_MAX_HELD_LOCKS] PRELOAD_TLS;
+static thread_local int num_held_locks PRELOAD_TLS = 0;
+
+static int (*real_mutex_lock)(pthread_mutex_t *);
+static int (*real_mutex_trylock)(pthread_mutex_t *);
+static int (*real_mutex_unlock)(pthread_mutex_t *);
+static int (*real_cond_wait)(pthread_cond_t *, pthread_mutex_t *);
+static int (*real_cond_timedwait)(pthread_cond_t *, pthread_mutex_t *, const struct timespec *);
+
+/*
+	Looks up the next definition of the function,
+	in the given symbol version if any.
+*/
+template <typename T>
+static void resolve(T & fn, const char * name, const char * version = nullptr) {
+	if (version) {
+		fn = (T)dlvsym(RTLD_NEXT, name, version);
+	}
+	if (!fn) {
+		fn = (T)dlsym(RTLD_NEXT, name);
+	}
+}
+
+/*
+	Called on first use rather than at load time, since the
+	constructors of other libraries might already take locks.
+*/
+static void resolve_pthread() {
+	resolve(real_mutex_lock, "pthread_mutex_lock");
+	resolve(real_mutex_trylock, "pthread_mutex_trylock");
+	resolve(real_mutex_unlock, "pthread_mutex_unlock");
+	// An unversioned lookup returns the cond functions of the old ABI
+	resolve(real_cond_wait, "pthread_cond_wait", "GLIBC_2.3.2");
+	resolve(real_cond_timedwait, "pthread_cond_timedwait", "GLIBC_2.3.2");
+}
+
+/*
+	Returns the span to log the call on and enters the hook,
+	or returns null if the call must be passed through.
+*/
+static const span * enter_hook(Instrum_category category) {
+	if (in_hook || !instrum_active_span) {
+		return nullptr;
+	}
+	const span * s = instrum_active_span(category);
+	in_hook = s != nullptr;
+	return s;
+}
+
+/*
+	Leaves the hook entered by enter_hook when going out of scope.
+*/
+struct hook_scope {
+	~hook_scope() {
+		in_hook = false;
+	}
+};
+
+/*
+	Returns the entry of the lock if it was taken inside a span.
+*/
+static held_lock * find_held_lock(pthread_mutex_t * mutex) {
+	for (int i = num_held_locks - 1; i >= 0; --i) {
+		if (held_locks[i].mutex == mutex) {
+			return &held_locks[i];
+		}
+	}
+	return nullptr;
+}
+
+static void add_held_lock(pthread_mutex_t * mutex, uint64_t hold_start_time) {
+	if (num_held_locks < PRELOAD_MAX_HELD_LOCKS) {
+		held_locks[num_held_locks++] = {mutex, hold_start_time};
+	}
+}
+
+static void remove_held_lock(held_lock * lock) {
+	*lock = held_locks[--num_held_locks];
+}
+
+extern "C" {
+
+void* malloc(size_t size) {
+	if (const span * s = enter_hook(memory_category)) {
+		hook_scope scope;
+		return instrum_malloc(*s, size);
+	}
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t num, size_t size) {
+	if (const span * s = enter_hook(memory_category)) {
+		hook_scope scope;
+		return instrum_calloc(*s, num, size);
+	}
+	return __libc_calloc(num, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+	// realloc(ptr, 0) frees ptr and returns null, which
+	// instrum_realloc would take for an allocation failure
+	// and keep the freed block in the table
+	if (size > 0) {
+		if (const span * s = enter_hook(memory_category)) {
+			hook_scope scope;
+			return instrum_realloc(*s, ptr, size);
+		}
+	}
+	if (ptr && !in_hook && instrum_forget_alloc) {
+		instrum_forget_alloc(ptr);
+	}
+	return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr) {
+	if (ptr) {
+		if (const span * s = enter_hook(memory_category)) {
+			hook_scope scope;
+			instrum_free(*s, ptr);
+			return;
+		}
+		// A block allocated in a span may be freed outside of one
+		if (!in_hook && instrum_forget_alloc) {
+			instrum_forget_alloc(ptr);
+		}
+	}
+	__libc_free(ptr);
+}
+
+int pthread_mutex_lock(pthread_mutex_t * mutex) {
+	if (!real_mutex_lock) {
+		resolve_pthread();
+	}
+	if (const span * s = enter_hook(locks_category)) {
+		hook_scope scope;
+		custom_mutex lock = {0, mutex};
+		int result = instrum_mutex_lock(*s, &lock);
+		if (result == 0) {
+			add_held_lock(mutex, lock.hold_start_time);
+		}
+		return result;
+	}
+	return real_mutex_lock(mutex);
+}
+
+int pthread_mutex_trylock(pthread_mutex_t * mutex) {
+	if (!real_mutex_trylock) {
+		resolve_pthread();
+	}
+	if (const span * s = enter_hook(locks_category)) {
+		hook_scope scope;
+		custom_mutex lock = {0, mutex};
+		int result = instrum_mutex_trylock(*s, &lock);
+		if (result == 0) {
+			add_held_lock(mutex, lock.hold_start_time);
+		}
+		return result;
+	}
+	return real_mutex_trylock(mutex);
+}
+
+int pthread_mutex_unlock(pthread_mutex_t * mutex) {
+	if (!real_mutex_unlock) {
+		resolve_pthread();
+	}
+	// Locks taken outside of a span have no hold time to log. The ones
+	// taken inside are forgotten even if released outside of one
+	if (held_lock * held = in_hook ? nullptr : find_held_lock(mutex)) {
+		custom_mutex lock = {held->hold_start_time, mutex};
+		remove_held_lock(held);
+		if (const span * s = enter_hook(locks_category)) {
+			hook_scope scope;
+			return instrum_mutex_unlock(*s, &lock);
+		}
+	}
+	return real_mutex_unlock(mutex);
+}
+
+int pthread_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex) {
+	if (!real_cond_wait) {
+		resolve_pthread();
+	}
+	if (const span * s = enter_hook(locks_category)) {
+		hook_scope scope;
+		if (held_lock * held = find_held_lock(mutex)) {
+			custom_mutex lock = {held->hold_start_time, mutex};
+			int result = instrum_cond_wait(*s, cond, &lock);
+			held->hold_start_time = lock.hold_start_time;
+			return result;
+		}
+	}
+	return real_cond_wait(cond, mutex);
+}
+
+int pthread_cond_timedwait(pthread_cond_t * cond, pthread_mutex_t * mutex, const struct timespec * abstime) {
+	if (!real_cond_timedwait) {
+		resolve_pthread();
+	}
+	if (const span * s = enter_hook(locks_category)) {
+		hook_scope scope;
+		if (held_lock * held = find_held_lock(mutex)) {
+			custom_mutex lock = {held->hold_start_time, mutex};
+			int result = instrum_cond_timedwait(*s, cond, &lock, abstime);
+			held->hold_start_time = lock.hold_start_time;
+			return result;
+		}
+	}
+	return real_cond_timedwait(cond, mutex, abstime);
+}
+
+}
@@ -23,93 +23,246 @@
 #include <filesystem>
 #include <stdio.h>
 #include <random>
+#include <signal.h>
 
 #include <grpcpp/grpcpp.h>
+#include <grpcpp/alarm.h>
 #include <grpcpp/health_check_service_interface.h>
 #include <grpcpp/ext/proto_server_reflection_plugin.h>
 
 #include "jung.grpc.pb.h"
 #include "custom_instr.h"
+#include "jung_interceptors.h"
 
 #define SERVER_PORT 50051
 #define VERBOSE true
 #define CLEAR_LOG true
 
+using grpc::Alarm;
 using grpc::Server;
+using grpc::ServerAsyncResponseWriter;
 using grpc::ServerBuilder;
+using grpc::ServerCompletionQueue;
 using grpc::ServerContext;
 using grpc::Status;
 using jung::JungRequest;
 using jung::JungReply;
 using jung::Jung;
+using jung::JungMetrics;
+using jung::MetricsRequest;
+using jung::MetricsReply;
 
 using namespace std;
 
-// Global counter for IDs
-int reply_id = 0;
+/*
+	Logic behind the server's behavior, shared by the synchronous
+	and the asynchronous mode. The span of the RPC is started
+	by the interceptors, see add_server_instrum.
+*/
+void greet(const span & s, const JungRequest* request, JungReply* reply) {
+	// Allocate a byte of memory but free it immediately
+	void* mem_p = custom_malloc(s, 1);
 
-// Logic and data behind the server's behavior.
-class JungServiceImpl final : public Jung::Service {
-	Status Greet(ServerContext* context, const JungRequest* request,
-					JungReply* reply) override {
-		string func_name =  __func__;
-		func_name += to_string(getNextUid(func_name)) + " " + to_string(++reply_id);
-		start_instrum(func_name, server, { make_feature("msg_len", "int", to_string(request->message().length())) });
+	reply->set_message("Ciao " + request->message());
+	reply->set_id(s.rpc_id);
 
-		// Allocate a byte of memory but free it immediately
-		void* mem_p = custom_malloc(func_name, 1);
+	custom_free(s, mem_p);
 
-		reply->set_message("Ciao " + request->message());
-		reply->set_id(reply_id);
+	if (VERBOSE) {
+		cout << "Received Greet" << s.uid << " " << s.rpc_id << ": " << request->message() << endl;
+	}
+}
 
-		custom_free(func_name, mem_p);
+/*
+	Returns how long the request should then take,
+	to simulate a computation.
+*/
+chrono::seconds return_double(const span & s, const JungRequest* request, JungReply* reply) {
+	reply->set_message(to_string(stoi(request->message()) * 2));
+	reply->set_id(s.rpc_id);
 
-		if (VERBOSE) {
-			cout << "Received " << func_name << ": " << request->message() << endl;
-		}
-		finish_instrum(func_name);
+	// Allocate some memory without freeing it. Should warn
+	custom_malloc(s, stoi(request->message()));
+
+	if (VERBOSE) {
+		cout << "Received ReturnDouble" << s.uid << " " << s.rpc_id << ", param: " << request->message();
+	}
+
+	// The given seconds / 2, with the addition
+	// of some randomness to spice it up
+	random_device rd;
+	mt19937 gen(rd());
+	double param = stod(request->message());
+	if (param < 1) {
+		param = 1;
+	}
+	exponential_distribution<> d(1.0 / param);
+	int val = (int)d(gen);
+	if (VERBOSE) {
+		cout << " - d: " << val << endl;
+	}
+	return chrono::seconds(val / 2);
+}
+
+// Synchronous mode: each RPC holds a gRPC thread until it is done
+class JungServiceImpl final : public Jung::Service {
+	Status Greet(ServerContext* context, const JungRequest* request,
+					JungReply* reply) override {
+		greet(current_span(), request, reply);
 		return Status::OK;
 	}
 
 	Status ReturnDouble(ServerContext* context, const JungRequest* request,
 							JungReply* reply) override {
-		string func_name =  __func__;
-		func_name += to_string(getNextUid(func_name)) + " " + to_string(++reply_id);
-		start_instrum(func_name, server, { make_feature("d", "double", request->message()) });
+		this_thread::sleep_for(return_double(current_span(), request, reply));
+		return Status::OK;
+	}
+};
+
+/*
+	Asynchronous mode: an RPC in progress, driven by the pollers
+	of its completion queue. Each operation it starts has the
+	call as tag, and the poller that gets it calls Proceed.
+*/
+class CallData {
+	public:
+		virtual ~CallData() {}
+		// ok is false if the operation failed, e.g. on shutdown
+		virtual void Proceed(bool ok) = 0;
+};
 
-		reply->set_message(to_string(stoi(request->message()) * 2));
-		reply->set_id(reply_id);
+class GreetCall final : public CallData {
+	public:
+		GreetCall(Jung::AsyncService* service, ServerCompletionQueue* cq)
+		: service_(service), cq_(cq), responder_(&ctx_) {
+			service_->RequestGreet(&ctx_, &request_, &responder_, cq_, cq_, this);
+		}
 
-		// Allocate some memory without freeing it. Should warn
-		custom_malloc(func_name, stoi(request->message()));
+		void Proceed(bool ok) override {
+			if (!ok || finishing_) {
+				delete this;
+				return;
+			}
+			// Wait for the next RPC while serving this one
+			new GreetCall(service_, cq_);
 
-		if (VERBOSE) {
-			cout << "Received " << func_name << ", param: " << request->message();
+			greet(resume_rpc_span(&ctx_), &request_, &reply_);
+			finishing_ = true;
+			responder_.Finish(reply_, Status::OK, this);
 		}
 
-		// Simulate a computation by sleeping for the given seconds / 2,
-		// with the addition of some randomness to spice it up
-		random_device rd;
-		mt19937 gen(rd());
-		double param = stod(request->message());
-		if (param < 1) {
-			param = 1;
+	private:
+		Jung::AsyncService* service_;
+		ServerCompletionQueue* cq_;
+		ServerContext ctx_;
+		JungRequest request_;
+		JungReply reply_;
+		ServerAsyncResponseWriter<JungReply> responder_;
+		bool finishing_ = false;
+};
+
+class ReturnDoubleCall final : public CallData {
+	public:
+		ReturnDoubleCall(Jung::AsyncService* service, ServerCompletionQueue* cq)
+		: service_(service), cq_(cq), responder_(&ctx_) {
+			service_->RequestReturnDouble(&ctx_, &request_, &responder_, cq_, cq_, this);
 		}
-		exponential_distribution<> d(1.0 / param);
-		int val = (int)d(gen);
-		if (VERBOSE) {
-			cout << " - d: " << val << endl;
+
+		void Proceed(bool ok) override {
+			chrono::seconds delay;
+			switch (state_) {
+				case REQUESTED:
+					if (!ok) {
+						delete this;
+						return;
+					}
+					new ReturnDoubleCall(service_, cq_);
+
+					s_ = resume_rpc_span(&ctx_);
+					delay = return_double(s_, &request_, &reply_);
+					// Wait on the queue rather than sleeping on a poller, which
+					// serves other RPCs meanwhile. The poller that gets the alarm
+					// takes the span over, so it must be suspended before
+					suspend_instrum(s_);
+					state_ = WAITING;
+					alarm_.Set(cq_, chrono::system_clock::now() + delay, this);
+					break;
+
+				case WAITING:
+					resume_instrum(s_);
+					state_ = FINISHING;
+					responder_.Finish(reply_, Status::OK, this);
+					break;
+
+				case FINISHING:
+					delete this;
+					break;
+			}
 		}
-		this_thread::sleep_for(chrono::seconds(val / 2));
 
-		finish_instrum(func_name);
+	private:
+		enum State { REQUESTED, WAITING, FINISHING };
+
+		Jung::AsyncService* service_;
+		ServerCompletionQueue* cq_;
+		ServerContext ctx_;
+		JungRequest request_;
+		JungReply reply_;
+		ServerAsyncResponseWriter<JungReply> responder_;
+		Alarm alarm_;
+		span s_;
+		State state_ = REQUESTED;
+};
+
+/*
+	Runs the calls of the completion queue until it is shut down.
+*/
+void poll_queue(ServerCompletionQueue* cq) {
+	void* tag;
+	bool ok;
+	while (cq->Next(&tag, &ok)) {
+		static_cast<CallData*>(tag)->Proceed(ok);
+	}
+}
+
+// Serves the live aggregates of the instrumentation, not instrumented itself (see run_server)
+class JungMetricsImpl final : public JungMetrics::Service {
+	Status GetMetrics(ServerContext* context, const MetricsRequest* request,
+						MetricsReply* reply) override {
+		for (const func_metrics & m : get_live_metrics(request->window_ms())) {
+			if (!request->function().empty() && request->function() != m.name) {
+				continue;
+			}
+			auto * f = reply->add_functions();
+			f->set_name(m.name);
+			f->set_count(m.count);
+			f->set_mean(m.mean);
+			f->set_p50(m.p50);
+			f->set_p99(m.p99);
+			f->set_max(m.max);
+			f->set_allocated_bytes(m.allocated);
+			f->set_lock_wait(m.lock_wait);
+		}
 		return Status::OK;
 	}
 };
 
-void run_server() {
+static bool is_number(const string & s) {
+	return !s.empty() && s.find_first_not_of("0123456789") == string::npos;
+}
+
+/*
+	Runs the server until Ctrl-C/SIGTERM. In asynchronous mode,
+	each of the cqs completion queues has pollers threads that
+	serve its RPCs, otherwise gRPC runs the handlers on up to
+	pollers threads per queue.
+*/
+void run_server(bool async, int cqs, int pollers) {
 	string server_address("0.0.0.0:" + to_string(SERVER_PORT));
 	JungServiceImpl service;
+	Jung::AsyncService async_service;
+	JungMetricsImpl metrics_service;
+	set_live_metrics(true);
 
 	grpc::EnableDefaultHealthCheckService(true);
 	grpc::reflection::InitProtoReflectionServerBuilderPlugin();
@@ -117,24 +270,109 @@ void run_server() {
 	// Listen on the given address without any authentication mechanism.
 	builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
 	// Register "service" as the instance through which we'll communicate with
-	// clients. In this case it corresponds to an *synchronous* service.
-	builder.RegisterService(&service);
+	// clients. The metrics are always served synchronously.
+	vector<unique_ptr<ServerCompletionQueue>> queues;
+	if (async) {
+		builder.RegisterService(&async_service);
+		for (int i = 0; i < cqs; ++i) {
+			queues.push_back(builder.AddCompletionQueue());
+		}
+	} else {
+		builder.RegisterService(&service);
+		builder.SetSyncServerOption(ServerBuilder::SyncServerOption::NUM_CQS, cqs);
+		builder.SetSyncServerOption(ServerBuilder::SyncServerOption::MIN_POLLERS, 1);
+		builder.SetSyncServerOption(ServerBuilder::SyncServerOption::MAX_POLLERS, pollers);
+	}
+	builder.RegisterService(&metrics_service);
+	// Instrument every RPC but the metrics ones
+	add_server_instrum(builder, { JungMetrics::service_full_name() },
+		async ? vector<string>{ Jung::service_full_name() } : vector<string>());
 	// Finally assemble the server.
 	unique_ptr<Server> server(builder.BuildAndStart());
-	cout << "Jung server listening on " << server_address << endl;
+	cout << "Jung server listening on " << server_address << (async ? " (async)" : "") << endl;
+
+	vector<thread> poller_threads;
+	for (auto & cq : queues) {
+		// Wait for the first RPC of each method
+		new GreetCall(&async_service, cq.get());
+		new ReturnDoubleCall(&async_service, cq.get());
+		for (int i = 0; i < pollers; ++i) {
+			poller_threads.emplace_back(poll_queue, cq.get());
+		}
+	}
+
+	// Shut down on Ctrl-C/SIGTERM, so that main returns and the
+	// instrumentation flushes the last log lines on exit
+	thread signal_waiter([&server, &queues]() {
+		sigset_t signals;
+		int sig;
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGINT);
+		sigaddset(&signals, SIGTERM);
+		sigwait(&signals, &sig);
+		cout << "Shutting down..." << endl;
+		// Waits for the RPCs in progress, then drains the queues
+		server->Shutdown();
+		for (auto & cq : queues) {
+			cq->Shutdown();
+		}
+	});
 
 	// Wait for the server to shutdown. Note that some other thread must be
 	// responsible for shutting down the server for this call to ever return.
 	server->Wait();
+	signal_waiter.join();
+	for (thread & t : poller_threads) {
+		t.join();
+	}
 }
 
 int main(int argc, char** argv) {
-	if (filesystem::exists(SERVER_LOGFILE) && CLEAR_LOG) {
+	// Block the termination signals before any thread is spawned,
+	// so that they are only delivered to the waiter in run_server
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	// With --async, serve the RPCs from completion queues
+	string async_str("--async");
+	string cqs_str("--cqs");
+	string pollers_str("--pollers");
+	bool async = false;
+	int cqs = 1;
+	int pollers = thread::hardware_concurrency() ? thread::hardware_concurrency() : 1;
+
+	for (int i = 1; i < argc; ++i) {
+		string arg_val = argv[i];
+
+		if (arg_val == async_str) {
+			async = true;
+		} else if (arg_val.rfind(cqs_str + "=", 0) == 0 && is_number(arg_val.substr(cqs_str.size() + 1))) {
+			cqs = stoi(arg_val.substr(cqs_str.size() + 1));
+		} else if (arg_val.rfind(pollers_str + "=", 0) == 0 && is_number(arg_val.substr(pollers_str.size() + 1))) {
+			pollers = stoi(arg_val.substr(pollers_str.size() + 1));
+		} else {
+			cerr << "Usage: " << argv[0] << " [--async] [--cqs=num_queues] [--pollers=threads_per_queue]" << endl;
+			return EXIT_FAILURE;
+		}
+	}
+	if (cqs < 1 || pollers < 1) {
+		cerr << "Error: there must be at least one completion queue and one poller" << endl;
+		return EXIT_FAILURE;
+	}
+
+	if ((filesystem::exists(SERVER_LOGFILE) || filesystem::exists(SERVER_BINLOG) || 
+		filesystem::exists(SERVER_SEGDIR)) && CLEAR_LOG) {
 		cout << "Removing previous logs..." << endl;
 		remove(SERVER_LOGFILE);
+		remove(SERVER_BINLOG);
+		filesystem::remove_all(SERVER_SEGDIR);
+		remove(SERVER_LOCKSTATS);
 	}
 
-	run_server();
+	run_server(async, cqs, pollers);
 
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,305 @@
+/*
+ *
+ * Copyright 2021 Stefano Taillefert.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+
+#ifndef LOG_FORMAT_H_INCLUDED
+#define LOG_FORMAT_H_INCLUDED
+
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+
+/*
+	On-disk format of the logs, shared by the instrumentation
+	library (writer) and trace_merge (reader).
+
+	Binary log layout:
+	  log_file_header, then a sequence of records, each made of
+	  a record_header followed by payload_len bytes of varints:
+	    timestamp, one varint per argument of the record type,
+	    and for events with text, its length followed by the bytes.
+	Function names are interned: a FUNC_NAME record defines
+	the id before any FUNC_START refers to it.
+	A span started for an RPC whose caller sent its trace context
+	is followed by a TRACE record: the trace id and the global id
+	of the calling span, which lives in another process.
+
+	Timestamps are in the unit given in the header. The one of
+	FUNC_START is relative to the time base of the log, the ones
+	of the other events to the start of their span.
+	A new log_file_header may appear between two records when
+	several captures are appended to the same file, or when
+	records were lost (see LOG_FLAG_LOSSY). A log can also be
+	split into segment files, each one starting with a header
+	and the definition of all the function names known so far.
+	The preallocated tail of a segment that was not closed is
+	zero-filled, which no record header can be.
+*/
+
+#define LOG_MAGIC "JUNGLOG"
+#define LOG_VERSION 10
+
+enum event_type : uint8_t {
+	FUNC_START,
+	FUNC_END,
+	RPC_START,
+	RPC_END,
+	MALLOC,
+	REALLOC,
+	FREE,
+	MUTEX_LOCK,
+	MUTEX_TRYLOCK,
+	MUTEX_UNLOCK,
+	COND_WAIT_RETURNED,
+	COND_TIMEDWAIT_RETURNED,
+	PAGEFAULT,
+	CPU_TIME,
+	CONTEXT_SWITCHES,
+	MEMORY,
+	PERF_HW,
+	PERF_SW,
+	TRACE,
+	RPC_TIMES,
+	RPC_STATUS,
+	FUNC_NAME,
+	USER_EVENT,
+	NUM_EVENT_TYPES
+};
+
+enum Time_unit : uint8_t { unit_ns, unit_us, unit_ms, unit_s };
+
+enum Clock_source : uint8_t { steady_clock_source, tsc_clock_source };
+
+// Flags of a MUTEX_UNLOCK event issued by a cond_wait
+#define UNLOCK_COND_WAIT 1
+#define UNLOCK_COND_TIMEDWAIT 2
+
+// Flag of a log_file_header: records were dropped before it,
+// so records of spans started before the drop may follow
+#define LOG_FLAG_LOSSY 1
+// Flag of the log_file_header of a segment after the first one:
+// the capture goes on, so spans started in the previous segment may end here
+#define LOG_FLAG_CONTINUED 2
+
+struct log_file_header {
+	char magic[8];
+	uint8_t version;
+	uint8_t side;
+	uint8_t time_unit;
+	uint8_t clock_source;
+	uint8_t flags;
+	uint8_t reserved[3];
+	// Wall-clock time of timestamp 0, in ns since the Unix epoch
+	uint64_t time_base;
+	// Random tag of the process, the high half of its global span
+	// and RPC ids (the low half being the local one), see TRACE
+	uint32_t process_tag;
+	uint8_t reserved2[4];
+};
+
+struct record_header {
+	uint8_t type;
+	uint8_t flags;
+	uint16_t payload_len;
+	// 0 for records that do not belong to a span (FUNC_NAME)
+	uint32_t span_id;
+};
+
+#define SHM_MAGIC "JUNGSHM"
+
+/*
+	Header of the shared-memory ring written by the instrumentation
+	and drained by jung_collector. It is followed by capacity bytes
+	of data, a byte stream holding a binary log (log_file_header
+	included). head and tail count the bytes written and read so far.
+	Whole batches are dropped, and counted, when there is no room.
+*/
+struct shm_ring_header {
+	char magic[8];
+	uint32_t version;
+	// Set by the instrumentation when the process exits
+	std::atomic<uint32_t> closed;
+	// Of the process, which does not close the ring if it is killed or crashes
+	int32_t pid;
+	uint8_t reserved[4];
+	// Power of two
+	uint64_t capacity;
+	std::atomic<uint64_t> head;
+	std::atomic<uint64_t> tail;
+	std::atomic<uint64_t> dropped_batches;
+	std::atomic<uint64_t> dropped_bytes;
+};
+
+static_assert(sizeof(log_file_header) == 32, "unexpected log_file_header padding");
+static_assert(sizeof(record_header) == 8, "unexpected record_header padding");
+static_assert(sizeof(shm_ring_header) == 64, "unexpected shm_ring_header padding");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shm_ring_header needs lock-free atomics");
+
+/*
+	Name of the event as written in the text logs.
+*/
+inline const char * event_name(event_type type) {
+	static const char * names[NUM_EVENT_TYPES] = {
+		"FUNC_START", "FUNC_END", "RPC_start", "RPC_end", "malloc", "realloc", "free",
+		"mutex_lock", "mutex_trylock", "mutex_unlock", "cond_wait_returned",
+		"cond_timedwait_returned", "pagefault", "cpu_time", "context_switches", "memory", "perf_hw", "perf_sw", 
+		"trace", "rpc_times", "rpc_status", "FUNC_NAME", ""
+	};
+	return type < NUM_EVENT_TYPES ? names[type] : "";
+}
+
+/*
+	Short name of the time unit, e.g. ms.
+*/
+inline const char * time_unit_name(Time_unit unit) {
+	static const char * names[] = { "ns", "us", "ms", "s" };
+	return unit <= unit_s ? names[unit] : "?";
+}
+
+/*
+	Looks up a time unit from its short name.
+	Returns false if the name is not a known unit.
+*/
+inline bool parse_time_unit(const std::string & name, Time_unit & unit) {
+	for (int i = unit_ns; i <= unit_s; ++i) {
+		if (name == time_unit_name((Time_unit)i)) {
+			unit = (Time_unit)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+	Number of nanoseconds in the time unit.
+*/
+inline uint64_t time_unit_ns(Time_unit unit) {
+	static const uint64_t factors[] = { 1, 1000, 1000000, 1000000000 };
+	return unit <= unit_s ? factors[unit] : 1;
+}
+
+/*
+	Whether the arguments of the event are durations,
+	expressed in the time unit of the log.
+*/
+inline bool event_args_are_time(event_type type) {
+	return type == MUTEX_LOCK || type == MUTEX_UNLOCK || 
+		type == COND_WAIT_RETURNED || type == COND_TIMEDWAIT_RETURNED || type == CPU_TIME || type == RPC_TIMES;
+}
+
+/*
+	Number of integer arguments of the event in the text log.
+*/
+inline int event_nargs(event_type type) {
+	switch (type) {
+		case RPC_END:
+		case MALLOC:
+		case FREE:
+		case MUTEX_LOCK:
+		case MUTEX_UNLOCK:
+		case COND_WAIT_RETURNED:
+		case COND_TIMEDWAIT_RETURNED:
+			return 1;
+		case REALLOC:
+		case PAGEFAULT:
+		case CONTEXT_SWITCHES:
+		case TRACE:
+		case RPC_TIMES:
+			return 2;
+		case PERF_SW:
+		case CPU_TIME:
+		case RPC_STATUS:
+			return 3;
+		case MEMORY:
+		case PERF_HW:
+			return 4;
+		default:
+			return 0;
+	}
+}
+
+/*
+	Number of integer arguments of the record in the binary log.
+	In text logs, those of FUNC_START (function id, uid and
+	RPC id + 1) and FUNC_NAME (function id) are part of the name,
+	and the sampling weight of FUNC_START (the number of runs the
+	span stands for) follows the event as [1/weight] if above 1,
+	then its parent span (0 if none) as e.g. [parent=Greet3].
+*/
+inline int record_nargs(event_type type) {
+	switch (type) {
+		case FUNC_START:
+			return 5;
+		case FUNC_NAME:
+			return 1;
+		default:
+			return event_nargs(type);
+	}
+}
+
+/*
+	Whether the event carries a text payload: the features
+	for FUNC_START, the name for FUNC_NAME, the message for USER_EVENT.
+*/
+inline bool event_has_text(event_type type) {
+	return type == FUNC_START || type == FUNC_NAME || type == USER_EVENT;
+}
+
+/*
+	Looks up the type of an event from its text name.
+	Returns false if the name is not a known event.
+*/
+inline bool parse_event_name(std::string_view name, event_type & type) {
+	for (int i = 0; i < USER_EVENT; ++i) {
+		if (name == event_name((event_type)i)) {
+			type = (event_type)i;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+	Appends v to out as a LEB128 varint.
+*/
+inline void put_varint(std::string & out, uint64_t v) {
+	while (v >= 0x80) {
+		out += (char)(v | 0x80);
+		v >>= 7;
+	}
+	out += (char)v;
+}
+
+/*
+	Reads a LEB128 varint from p, advancing it.
+	Returns false if the input ends before the varint does.
+*/
+inline bool get_varint(const char *& p, const char * end, uint64_t & v) {
+	v = 0;
+	for (int shift = 0; p < end && shift < 64; shift += 7) {
+		uint8_t byte = *p++;
+		v |= (uint64_t)(byte & 0x7f) << shift;
+		if (!(byte & 0x80)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+#endif
@@ -23,501 +23,1984 @@
 #include <tuple>
 #include <unordered_map>
 #include <set>
+#include <queue>
+#include <string_view>
+#include <charconv>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <filesystem>
+#include <thread>
+#include <atomic>
 
 #include "trace_merge.h"
 
 using namespace std;
 
-vector<tuple<int, int>> server_log_indices;
-vector<string> server_log_lines;
+// What the server logged for each RPC id, see preprocess_server_log
+unordered_map<int64_t, server_rpc> server_rpcs;
+// Log files, segment directories or directories of logs
+// of each side given on the command line, see find_logs
+vector<string> server_log_paths, client_log_paths;
+// Threads parsing and aggregating the logs, see --threads
+size_t num_threads = 1;
+// How late (in ms) an entry can be in its log with respect
+// to the ones written after it, see simple_merge and --window
+uint64_t merge_window = 1000;
+
+// Bounds of the size of the chunks the logs are split into with several
+// threads, and how many chunks are parsed before being aggregated
+#define MIN_CHUNK_SIZE (64 * 1024)
+#define MAX_CHUNK_SIZE (4 * 1024 * 1024)
+#define CHUNKS_PER_THREAD 4
 
-/* 
-    Helper function to parse the server log file
-    and store indices of lines to simplify
-    and speed up further access.
+/*
+    Helper function to map the file in memory, so that it
+    is parsed in place. An empty file is not mapped.
 */
-void preprocess_server_log() {
-    ifstream server_log;
+static const char * map_file(const string & path, size_t & size) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0) {
+        cerr << "Error: cannot open " << path << endl;
+        exit(EXIT_FAILURE);
+    }
+    void * data = nullptr;
+    size = st.st_size;
+    // An empty file cannot be mapped, and has nothing to read anyway
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            cerr << "Error: cannot map " << path << endl;
+            exit(EXIT_FAILURE);
+        }
+        madvise(data, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    return (const char *)data;
+}
 
-    server_log.open(SERVER_LOGFILE);
+/*
+    Helper function to map the next file of the log.
+    Returns false if there is none left.
+*/
+static bool open_next_segment(log_reader & reader) {
+    if (reader.next_segment >= reader.segments.size()) {
+        return false;
+    }
+    close_log(reader);
+    reader.data = map_file(reader.segments[reader.next_segment++], reader.size);
+    return true;
+}
 
-    if (!server_log.is_open()) {
-        cerr << "Error: cannot open server log" << endl;
-        exit(EXIT_FAILURE);
+void close_log(log_reader & reader) {
+    if (reader.data) {
+        munmap((void *)reader.data, reader.size);
+    }
+    reader.data = nullptr;
+    reader.size = 0;
+    reader.pos = 0;
+}
+
+/*
+    Helper function to tell whether the directory holds
+    the segments of a log, e.g. 00000001.bin.
+*/
+static bool is_segment_dir(const filesystem::path & path) {
+    error_code error;
+    for (auto & entry : filesystem::directory_iterator(path, error)) {
+        string name = entry.path().filename().string();
+        if (entry.path().extension() == ".bin" && name.size() > 4 && name.find_first_not_of("0123456789") == name.size() - 4) {
+            return true;
+        }
+    }
+    return false;
+}
+
+vector<string> find_logs(Side side) {
+    vector<string> logs;
+    const vector<string> & paths = side == server ? server_log_paths : client_log_paths;
+    // By default, the segment directory, then the binary log, then the text one
+    if (paths.empty()) {
+        const char * server_paths[] = {SERVER_SEGDIR, SERVER_BINLOG, SERVER_LOGFILE};
+        const char * client_paths[] = {CLIENT_SEGDIR, CLIENT_BINLOG, CLIENT_LOGFILE};
+        for (const char * candidate : side == server ? server_paths : client_paths) {
+            if (filesystem::exists(candidate)) {
+                logs.push_back(candidate);
+                break;
+            }
+        }
+    }
+
+    for (const string & path : paths) {
+        error_code error;
+        if (!filesystem::is_directory(path, error) || is_segment_dir(path)) {
+            logs.push_back(path);
+            continue;
+        }
+        // The log files and segment directories it holds, e.g. gathered from several hosts
+        set<string> names;
+        for (auto & entry : filesystem::directory_iterator(path, error)) {
+            if (entry.is_directory(error) ? is_segment_dir(entry.path()) : 
+                    (entry.path().extension() == ".bin" || entry.path().extension() == ".txt")) {
+                names.insert(entry.path().string());
+            }
+        }
+        logs.insert(logs.end(), names.begin(), names.end());
     }
 
-    string line;
-    int line_num = 0;
-    while(getline(server_log, line)) {
-        server_log_lines.push_back(line);
+    if (logs.empty()) {
+        cerr << "Error: cannot open " << (side == server ? "server" : "client") << " log" << endl;
+        exit(EXIT_FAILURE);
+    }
+    return logs;
+}
 
-        if (line.find(" FUNC_START") != string::npos) {
-            size_t pos;
-            vector<string> line_vect;
-            while ((pos = line.find(" ")) != string::npos) {
-                line_vect.push_back(line.substr(0, pos));
-                line.erase(0, pos + 1);
+void open_log(log_reader & reader, const string & path) {
+    error_code error;
+    if (filesystem::is_directory(path, error)) {
+        // Zero-padded numbers, so sorted in the order they were written
+        set<string> names;
+        for (auto & entry : filesystem::directory_iterator(path, error)) {
+            if (entry.path().extension() == ".bin") {
+                names.insert(entry.path().string());
             }
-            int index = stoi(line_vect[2]);
-            server_log_indices.push_back(make_tuple(index, line_num));
         }
+        reader.segments.assign(names.begin(), names.end());
+    } else {
+        reader.segments.push_back(path);
+    }
 
-        ++line_num;
+    if (reader.segments.empty() || !open_next_segment(reader)) {
+        cerr << "Error: cannot open " << path << endl;
+        exit(EXIT_FAILURE);
     }
 
-    server_log.close();
+    reader.binary = reader.size >= sizeof(LOG_MAGIC) && memcmp(reader.data, LOG_MAGIC, sizeof(LOG_MAGIC)) == 0;
 }
 
 /*
-    Helper function to get the line number of 
-    the start of a given RPC server execution.
+    Helper function to parse a decimal number of the text log.
 */
-int get_line_num(int RPC_id) {
-    int line_num;
-    for (auto t : server_log_indices) {
-        if (get<0>(t) == RPC_id) {
-            line_num = get<1>(t);
-            break;
-        }
+template <typename T>
+static T parse_number(string_view token) {
+    T value = 0;
+    auto result = from_chars(token.data(), token.data() + token.size(), value);
+    if (result.ec != errc() || result.ptr != token.data() + token.size()) {
+        cerr << "Error: incorrect log file format (" << token << " is not a number)" << endl;
+        exit(EXIT_FAILURE);
     }
-    return line_num;
+    return value;
 }
 
-/* 
-    Helper function to get the execution time on 
-    server side.
+static bool is_number(string_view s) {
+    return !s.empty() && s.find_first_not_of("0123456789") == string_view::npos;
+}
+
+/*
+    Helper function to split a text log name like
+    do_stuff12 into function name and uid.
 */
-uint64_t calc_server_time(string RPC_id) {
-    int line_num = get_line_num(stoi(RPC_id));
+static void split_uid(string_view name, string & func_name, uint32_t & uid) {
+    size_t uid_pos = name.find_last_not_of("0123456789") + 1;
+    func_name = name.substr(0, uid_pos);
+    uid = uid_pos < name.size() ? parse_number<uint32_t>(name.substr(uid_pos)) : 0;
+}
 
-    string line = server_log_lines[line_num];
-    uint64_t start_time = stol(line.substr(0, line.find(" ")));
-    
-    // Search for end time skipping eventual other lines
-    while (line.find(" " + RPC_id + " FUNC_END") == string::npos) {
-        line = server_log_lines[++line_num];
+/*
+    Helper function to split the tokens of a line
+    at each space, as views of the line.
+*/
+static void split_tokens(string_view line, vector<string_view> & tokens) {
+    tokens.clear();
+    size_t start = 0;
+    size_t pos;
+    while ((pos = line.find(' ', start)) != string_view::npos) {
+        tokens.push_back(line.substr(start, pos - start));
+        start = pos + 1;
     }
-    
-    return stol(line.substr(0, line.find(" "))) - start_time;
+    tokens.push_back(line.substr(start));
 }
 
-/* 
-    Helper function to get the memory usage 
-    and possible memory leaks on server side.
+/*
+    Helper function to parse the header line of a text log,
+    e.g. # jung v3 side=client unit=ns clock=steady base=1620000000000000000
+*/
+static void parse_text_header(log_reader & reader, string_view line) {
+    split_tokens(line, reader.tokens);
+    for (string_view token : reader.tokens) {
+        if (token.substr(0, 5) == "unit=" && !parse_time_unit(string(token.substr(5)), reader.time_unit)) {
+            cerr << "Error: unknown time unit (" << token << ")" << endl;
+            exit(EXIT_FAILURE);
+        } else if (token.substr(0, 5) == "base=") {
+            reader.time_base = parse_number<uint64_t>(token.substr(5));
+        } else if (token == "side=client" || token == "side=server") {
+            reader.side = token == "side=server" ? server : client;
+        } else if (token.substr(0, 8) == "process=") {
+            reader.process_tag = parse_number<uint32_t>(token.substr(8));
+        }
+    }
+
+    reader.span_starts.clear();
+}
+
+/*
+    Helper function to leave the entry of a chunk to be completed
+    once the chunks before it are read, see resolve_chunk.
+*/
+static void defer_entry(log_reader & reader, log_entry & entry, uint32_t span_id, const string & name) {
+    entry.deferred = true;
+    reader.deferred.emplace_back();
+    reader.deferred.back().span_id = span_id;
+    reader.deferred.back().name = name;
+}
+
+/*
+    Helper function to parse a line of a text log.
+    Returns false if the line is not an event.
 */
-tuple<uint64_t, uint64_t> calc_server_memory(string RPC_id) {
-    uint64_t mem_usage = 0;
-    uint64_t mem_leaks = 0;
+static bool parse_text_entry(log_reader & reader, string_view line, log_entry & entry) {
+    if (line.substr(0, 6) == "# jung") {
+        parse_text_header(reader, line);
+        return false;
+    }
+    if (line.empty() || line[0] == '#') {
+        return false;
+    }
+
+    vector<string_view> & tokens = reader.tokens;
+    split_tokens(line, tokens);
+    if (tokens.size() < 2) {
+        cerr << "Error: incorrect log file format (" << line << ")" << endl;
+        exit(EXIT_FAILURE);
+    }
 
-    int line_num = get_line_num(stoi(RPC_id));
+    entry = log_entry();
+    entry.process_tag = reader.process_tag;
+    entry.timestamp = parse_number<uint64_t>(tokens[0]);
+
+    // Server-side names are followed by the RPC id. Logs without
+    // a header do not tell their side, then any number after the
+    // name is taken for it
+    size_t i = 2;
+    split_uid(tokens[1], entry.func_name, entry.uid);
+    string_view full_name = tokens[1];
+    if (tokens.size() > 2 && reader.side != client && is_number(tokens[2])) {
+        entry.rpc_id = parse_number<int64_t>(tokens[2]);
+        full_name = line.substr(tokens[1].data() - line.data(), tokens[2].data() + tokens[2].size() - tokens[1].data());
+        ++i;
+    }
 
-    string line = server_log_lines[line_num];
-    while (line.find(" " + RPC_id + " FUNC_END") == string::npos) {
-        if (line.find(" " + RPC_id + " malloc") != string::npos) {
-            mem_usage = stol(line.substr(line.find("malloc ") + 7));
-            ++mem_leaks;
+    if (i < tokens.size() && parse_event_name(tokens[i], entry.type)) {
+        ++i;
+        for (int a = 0; a < event_nargs(entry.type) && i < tokens.size(); ++a, ++i) {
+            entry.args[a] = parse_number<uint64_t>(tokens[i]);
+        }
+        // Sampled span, e.g. [1/8]
+        if (entry.type == FUNC_START && i < tokens.size() && tokens[i].substr(0, 3) == "[1/") {
+            entry.weight = parse_number<uint32_t>(tokens[i].substr(3, tokens[i].size() - 4));
+            ++i;
         }
-        if (line.find(" " + RPC_id + " realloc") != string::npos) {
-            cout << "Found realloc call (RPC #" << RPC_id << "). Memory stats might be inaccurate" << endl;
+        // Nested span, e.g. [parent=do_stuff12]
+        if (entry.type == FUNC_START && i < tokens.size() && tokens[i].substr(0, 8) == "[parent=") {
+            split_uid(tokens[i].substr(8, tokens[i].size() - 9), entry.parent_name, entry.parent_uid);
+            ++i;
+        }
+        if (entry.type == MUTEX_UNLOCK && i < tokens.size()) {
+            if (tokens[i] == "[cond_wait]") {
+                entry.flags = UNLOCK_COND_WAIT;
+                ++i;
+            } else if (tokens[i] == "[cond_timedwait]") {
+                entry.flags = UNLOCK_COND_TIMEDWAIT;
+                ++i;
+            }
+        }
+    } else {
+        entry.type = USER_EVENT;
+    }
+
+    // The rest of the line, as is
+    if (i < tokens.size()) {
+        entry.text = line.substr(tokens[i].data() - line.data());
+    }
+
+    // Make the times absolute and in ns
+    uint64_t factor = time_unit_ns(reader.time_unit);
+    entry.timestamp *= factor;
+    for (int a = 0; a < event_nargs(entry.type) && event_args_are_time(entry.type); ++a) {
+        entry.args[a] *= factor;
+    }
+    // Entries of a span that was not started count from 0
+    string name(full_name);
+    if (entry.type == FUNC_START) {
+        reader.span_starts[name] = entry.timestamp;
+        if (reader.chunked) {
+            reader.ended_names.erase(name);
         }
-        if (line.find(" " + RPC_id + " free") != string::npos) {
-            --mem_leaks;
+    } else {
+        auto it = reader.span_starts.find(name);
+        if (it != reader.span_starts.end()) {
+            entry.timestamp += it->second;
+            if (entry.type == FUNC_END) {
+                reader.span_starts.erase(it);
+                if (reader.chunked) {
+                    reader.ended_names.insert(name);
+                }
+            }
+        } else if (reader.chunked && !reader.ended_names.count(name)) {
+            defer_entry(reader, entry, 0, name);
         }
-        line = server_log_lines[++line_num];
     }
 
-    return {mem_usage, mem_leaks};
+    return true;
 }
 
-/* 
-    Helper function to get the pagefaults 
-    on server side.
+/*
+    Helper function to decode a record of a binary log.
+    Returns false if the record is not an event.
 */
-tuple<uint64_t, uint64_t> calc_server_pagefaults(string RPC_id) {
-    tuple<uint64_t, uint64_t> result;
-    int line_num = get_line_num(stoi(RPC_id));
+static bool parse_binary_entry(log_reader & reader, const record_header & header, 
+ string_view payload, log_entry & entry) {
+    const char * p = payload.data();
+    const char * end = p + payload.size();
+    bool ok = true;
+
+    entry = log_entry();
+    entry.process_tag = reader.process_tag;
+    entry.type = (event_type)header.type;
+    entry.flags = header.flags;
+    ok = ok && get_varint(p, end, entry.timestamp);
+    for (int a = 0; a < record_nargs(entry.type); ++a) {
+        ok = ok && get_varint(p, end, entry.args[a]);
+    }
 
-    string line = server_log_lines[line_num];
-    while (line.find(" " + RPC_id + " FUNC_END") == string::npos) {
-        if (line.find(" " + RPC_id + " pagefault") != string::npos) {
-            size_t pos;
-            vector<string> line_vect;
-            while ((pos = line.find(" ")) != string::npos) {
-                line_vect.push_back(line.substr(0, pos));
-                line.erase(0, pos + 1);
-            }
-            line_vect.push_back(line);
-            result = {stol(line_vect[4]), stol(line_vect[5])};
+    if (event_has_text(entry.type)) {
+        uint64_t text_len = 0;
+        ok = ok && get_varint(p, end, text_len) && text_len <= (uint64_t)(end - p);
+        if (ok) {
+            entry.text.assign(p, text_len);
+        }
+    }
+
+    if (!ok || entry.type >= NUM_EVENT_TYPES) {
+        cerr << "Error: incorrect log file format (corrupted record)" << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (entry.type == FUNC_NAME) {
+        if (entry.args[0] >= reader.func_names.size()) {
+            reader.func_names.resize(entry.args[0] + 1);
+        }
+        reader.func_names[entry.args[0]] = entry.text;
+        return false;
+    }
+
+    if (entry.type == FUNC_START) {
+        if (entry.args[0] >= reader.func_names.size()) {
+            cerr << "Error: incorrect log file format (undefined function)" << endl;
+            exit(EXIT_FAILURE);
+        }
+        auto parent = reader.spans.find(entry.args[4]);
+        if (parent != reader.spans.end()) {
+            entry.parent_name = reader.func_names[get<0>(parent->second)];
+            entry.parent_uid = get<1>(parent->second);
+        } else if (entry.args[4] != 0 && reader.chunked && !reader.ended_spans.count(entry.args[4])) {
+            defer_entry(reader, entry, entry.args[4], "");
+        }
+        reader.spans[header.span_id] = make_tuple(entry.args[0], entry.args[1], (int64_t)entry.args[2] - 1, 
+            entry.timestamp * time_unit_ns(reader.time_unit));
+        if (reader.chunked) {
+            reader.ended_spans.erase(header.span_id);
         }
-        line = server_log_lines[++line_num];
+        entry.weight = max((uint64_t)1, entry.args[3]);
     }
 
-    return result;
+    auto it = reader.spans.find(header.span_id);
+    // Started before the chunk, if at all
+    bool deferred = it == reader.spans.end() && reader.chunked && !reader.ended_spans.count(header.span_id);
+    if (it == reader.spans.end() && !deferred && reader.lossy) {
+        // Its start was in a dropped batch
+        ++reader.skipped;
+        return false;
+    }
+    if (it == reader.spans.end() && !deferred) {
+        cerr << "Error: incorrect log file format (unknown span)" << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (deferred) {
+        defer_entry(reader, entry, header.span_id, "");
+    } else {
+        entry.func_name = reader.func_names[get<0>(it->second)];
+        entry.uid = get<1>(it->second);
+        entry.rpc_id = get<2>(it->second);
+    }
+
+    // Make the times absolute and in ns
+    uint64_t factor = time_unit_ns(reader.time_unit);
+    for (int a = 0; a < event_nargs(entry.type) && event_args_are_time(entry.type); ++a) {
+        entry.args[a] *= factor;
+    }
+    entry.timestamp = entry.type == FUNC_START || deferred ? entry.timestamp * factor : 
+        get<3>(it->second) + entry.timestamp * factor;
+
+    if (entry.type == FUNC_END && !deferred) {
+        reader.spans.erase(it);
+        if (reader.chunked) {
+            reader.ended_spans.insert(header.span_id);
+        }
+    }
+    return true;
 }
 
-void generate_perf_trace() {
-    ifstream client_log;
-    ofstream trace_log;
+/*
+    Helper function to read the header of the next record of the
+    binary log, without moving past it. Returns false at the end of
+    the file, or of the zero-filled tail of a segment that was not closed.
+*/
+static bool peek_record(const log_reader & reader, record_header & header) {
+    if (reader.size - reader.pos < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, reader.data + reader.pos, sizeof(header));
+    return header.type != 0 || header.flags != 0 || header.payload_len != 0 || header.span_id != 0;
+}
 
-    client_log.open(CLIENT_LOGFILE);
-    trace_log.open(TRACE_LOGFILE);
+static bool is_file_header(const record_header & header) {
+    return memcmp(&header, LOG_MAGIC, sizeof(header)) == 0;
+}
 
-    if (!client_log.is_open()) {
-        cerr << "Error: cannot open client log" << endl;
+/*
+    Helper function to read the log_file_header of a capture,
+    found where the next record was expected. Returns whether
+    it ended the spans open before it.
+*/
+static bool read_file_header(log_reader & reader) {
+    log_file_header file_header;
+    if (reader.size - reader.pos < sizeof(file_header)) {
+        cerr << "Error: incorrect log file format (truncated header)" << endl;
         exit(EXIT_FAILURE);
     }
+    memcpy(&file_header, reader.data + reader.pos, sizeof(file_header));
+    reader.pos += sizeof(file_header);
+    if (file_header.version != LOG_VERSION) {
+        cerr << "Error: unsupported log version " << (int)file_header.version << endl;
+        exit(EXIT_FAILURE);
+    }
+    // No time base yet: this is the first header of the log
+    bool first_header = reader.time_base == 0;
+    reader.time_unit = (Time_unit)file_header.time_unit;
+    reader.time_base = file_header.time_base;
+    reader.process_tag = file_header.process_tag;
+    reader.func_names.clear();
+    if ((file_header.flags & LOG_FLAG_LOSSY) || (first_header && (file_header.flags & LOG_FLAG_CONTINUED))) {
+        reader.lossy = true;
+    } else if (!(file_header.flags & LOG_FLAG_CONTINUED)) {
+        reader.spans.clear();
+        return true;
+    }
+    return false;
+}
 
-    if (!trace_log.is_open()) {
-        cerr << "Error: cannot write trace log" << endl;
+/*
+    Helper function to move past the record
+    whose header was peeked, returning its payload.
+*/
+static string_view read_payload(log_reader & reader, const record_header & header) {
+    reader.pos += sizeof(header);
+    if (reader.size - reader.pos < header.payload_len) {
+        cerr << "Error: incorrect log file format (truncated record)" << endl;
         exit(EXIT_FAILURE);
     }
+    string_view payload(reader.data + reader.pos, header.payload_len);
+    reader.pos += header.payload_len;
+    return payload;
+}
 
-    preprocess_server_log();
+bool read_entry(log_reader & reader, log_entry & entry) {
+    if (!reader.binary) {
+        do {
+            while (reader.pos < reader.size) {
+                // memchr scans a word (or vector) at a time
+                const char * line = reader.data + reader.pos;
+                const char * newline = (const char *)memchr(line, '\n', reader.size - reader.pos);
+                size_t length = newline ? newline - line : reader.size - reader.pos;
+                reader.pos += length + (newline != nullptr);
+                if (parse_text_entry(reader, string_view(line, length), entry)) {
+                    return true;
+                }
+            }
+        } while (open_next_segment(reader));
+        return false;
+    }
 
-    string line;
-    vector<string> line_vect;
-    size_t pos;
-    unordered_map<string, custom_func *> func_list;
+    record_header header;
+    while (true) {
+        if (!peek_record(reader, header)) {
+            if (!open_next_segment(reader)) {
+                return false;
+            }
+            continue;
+        }
 
-    // Get the client log file line by line
-    while(getline(client_log, line)) {
-        line_vect.clear();
-
-        // Separate the line on spaces and put the tokens in vector
-        while ((pos = line.find(" ")) != string::npos) {
-            line_vect.push_back(line.substr(0, pos));
-            line.erase(0, pos + 1);
-        }
-        line_vect.push_back(line);
-
-        // Extract sample uid and func name
-        // (e.g do_stuff1 is the first run of do_stuff).
-        // Regexes credit: some random stackoverflow post
-        uint32_t uid = stoi(regex_replace(
-            line_vect[1],
-            regex("[^0-9]*([0-9]+).*"),
-            string("$1")
-        ));
-        string f_name = regex_replace(
-            line_vect[1],
-            regex("([^0-9]+).*"),
-            string("$1")
-        );
-
-        if (line_vect[2] == "FUNC_START") {
-            vector<feature*> feature_list;
-            string param_name;
-            string param_type;
-            string param_value;
-            for (int i = 3; i < line_vect.size(); ++i) {
-                // Format: e.g. asd=int&12
-                param_name = line_vect[i].substr(0, line_vect[i].find("="));
-                param_type = line_vect[i].substr(line_vect[i].find("=") + 1, line_vect[i].find("&") - line_vect[i].find("=") - 1);
-                param_value = line_vect[i].substr(line_vect[i].find("&") + 1);
-                feature_list.push_back(make_feature(param_name, param_type, param_value));
+        // Start of another capture appended to the same file
+        if (is_file_header(header)) {
+            read_file_header(reader);
+            continue;
+        }
+
+        string_view payload = read_payload(reader, header);
+        // Function names are only needed to decode the next records
+        if (parse_binary_entry(reader, header, payload, entry)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+string format_entry(const log_entry & entry) {
+    string line = to_string(entry.timestamp) + " " + entry.func_name + to_string(entry.uid);
+    if (entry.rpc_id >= 0) {
+        line += " " + to_string(entry.rpc_id);
+    }
+    if (entry.type != USER_EVENT) {
+        line += " ";
+        line += event_name(entry.type);
+    }
+    if (entry.type == FUNC_START && entry.weight > 1) {
+        line += " [1/" + to_string(entry.weight) + "]";
+    }
+    if (entry.type == FUNC_START && !entry.parent_name.empty()) {
+        line += " [parent=" + entry.parent_name + to_string(entry.parent_uid) + "]";
+    }
+    for (int a = 0; a < event_nargs(entry.type); ++a) {
+        line += " " + to_string(entry.args[a]);
+    }
+    if (entry.type == MUTEX_UNLOCK && entry.flags == UNLOCK_COND_WAIT) {
+        line += " [cond_wait]";
+    } else if (entry.type == MUTEX_UNLOCK && entry.flags == UNLOCK_COND_TIMEDWAIT) {
+        line += " [cond_timedwait]";
+    }
+    if (!entry.text.empty()) {
+        line += " " + entry.text;
+    }
+    return line;
+}
+
+/*
+    Helper function to warn about the records skipped
+    because the shared-memory sink dropped their span start,
+    or the log did not have it.
+*/
+static void report_skipped(const log_reader & reader, Side side) {
+    if (reader.skipped > 0) {
+        cout << "Warning: skipped " << reader.skipped << " " << (side == server ? "server" : "client") 
+            << " record(s) of spans dropped before reaching the collector" << endl;
+    }
+}
+
+/*
+    Helper function to run body(i) for each i below n on up to num_threads threads.
+*/
+template <typename Body>
+static void parallel_for(size_t n, const Body & body) {
+    atomic<size_t> next(0);
+    auto work = [&] {
+        for (size_t i = next++; i < n; i = next++) {
+            body(i);
+        }
+    };
+    vector<thread> threads;
+    for (size_t t = 1; t < min(num_threads, n); ++t) {
+        threads.emplace_back(work);
+    }
+    work();
+    for (thread & t : threads) {
+        t.join();
+    }
+}
+
+/*
+    Helper function to find the next header line of a text log,
+    at or after the start of line pos. Returns the size of the log if none.
+*/
+static size_t find_text_header(const log_reader & reader, size_t pos) {
+    if (reader.size - pos >= 6 && memcmp(reader.data + pos, "# jung", 6) == 0) {
+        return pos;
+    }
+    const char * header = (const char *)memmem(reader.data + pos, reader.size - pos, "\n# jung", 7);
+    return header ? header + 1 - reader.data : reader.size;
+}
+
+/*
+    Helper function to split the log into chunks of about chunk_size bytes,
+    reading its headers and function names on the way. Its files are left
+    mapped, and added to files.
+*/
+static vector<log_chunk> split_log(log_reader & reader, size_t chunk_size, vector<pair<const char *, size_t>> & files) {
+    vector<log_chunk> chunks;
+    log_chunk chunk;
+    size_t begin = 0;
+    bool new_capture = false;
+    auto start_chunk = [&] {
+        begin = reader.pos;
+        chunk.time_unit = reader.time_unit;
+        chunk.time_base = reader.time_base;
+        chunk.process_tag = reader.process_tag;
+        chunk.side = reader.side;
+        chunk.lossy = reader.lossy;
+        chunk.func_names = reader.func_names;
+    };
+    auto end_chunk = [&] {
+        if (reader.pos > begin) {
+            chunk.data = reader.data + begin;
+            chunk.size = reader.pos - begin;
+            chunk.new_capture = new_capture;
+            new_capture = false;
+            chunks.push_back(chunk);
+        }
+    };
+
+    close_log(reader);
+    for (const string & path : reader.segments) {
+        reader.data = map_file(path, reader.size);
+        reader.pos = 0;
+        files.emplace_back(reader.data, reader.size);
+        start_chunk();
+
+        if (reader.binary) {
+            record_header header;
+            while (peek_record(reader, header)) {
+                if (is_file_header(header)) {
+                    end_chunk();
+                    new_capture = read_file_header(reader) || new_capture;
+                    start_chunk();
+                    continue;
+                }
+                if (reader.pos - begin >= chunk_size) {
+                    end_chunk();
+                    start_chunk();
+                }
+                string_view payload = read_payload(reader, header);
+                if (header.type == FUNC_NAME) {
+                    log_entry entry;
+                    parse_binary_entry(reader, header, payload, entry);
+                }
             }
-            
-            if (uid == 1) {
-                // First run of the function, create structs
-                func_list[f_name] = make_custom_func(f_name);
+        } else {
+            size_t next_header = find_text_header(reader, 0);
+            while (reader.pos < reader.size) {
+                if (reader.pos == next_header) {
+                    const char * line = reader.data + reader.pos;
+                    const char * newline = (const char *)memchr(line, '\n', reader.size - reader.pos);
+                    size_t length = newline ? newline - line : reader.size - reader.pos;
+                    parse_text_header(reader, string_view(line, length));
+                    reader.pos += length + (newline != nullptr);
+                    new_capture = true;
+                    next_header = find_text_header(reader, reader.pos);
+                    start_chunk();
+                    continue;
+                }
+                // Whole lines, up to the next header
+                size_t end = next_header;
+                if (end - reader.pos > chunk_size) {
+                    const char * newline = (const char *)memchr(reader.data + reader.pos + chunk_size, '\n', 
+                        end - reader.pos - chunk_size);
+                    end = newline ? newline + 1 - reader.data : end;
+                }
+                reader.pos = end;
+                end_chunk();
+                start_chunk();
             }
-            func_list[f_name]->sample_list[uid] = make_sample(uid);
-            func_list[f_name]->sample_list[uid]->feature_list = feature_list;
-            func_list[f_name]->sample_list[uid]->start_time = stol(line_vect[0]);
         }
+        end_chunk();
+    }
+    reader.data = nullptr;
+    close_log(reader);
+    return chunks;
+}
 
-        // Memory allocation
-        if (line_vect[2] == "malloc") {
-            func_list[f_name]->sample_list[uid]->memory_usage += stoi(line_vect[3]);
-            ++func_list[f_name]->sample_list[uid]->mem_leaks;
+/*
+    Helper function to read the entries of a chunk. Those of spans
+    started before it are deferred, see resolve_chunk.
+*/
+static void parse_chunk(const log_reader & reader, const log_chunk & chunk, log_reader & chunk_reader, 
+ vector<log_entry> & entries) {
+    chunk_reader.binary = reader.binary;
+    chunk_reader.data = chunk.data;
+    chunk_reader.size = chunk.size;
+    chunk_reader.time_unit = chunk.time_unit;
+    chunk_reader.time_base = chunk.time_base;
+    chunk_reader.process_tag = chunk.process_tag;
+    chunk_reader.side = chunk.side;
+    chunk_reader.lossy = chunk.lossy;
+    chunk_reader.func_names = chunk.func_names;
+    // The spans open before a new capture are not looked up
+    chunk_reader.chunked = !chunk.new_capture;
+
+    log_entry entry;
+    while (read_entry(chunk_reader, entry)) {
+        if (entry.deferred) {
+            chunk_reader.deferred.back().index = entries.size();
         }
+        entries.push_back(move(entry));
+    }
+    // The file belongs to the log
+    chunk_reader.data = nullptr;
+}
 
-        //Memory freeing
-        if (line_vect[2] == "free") {
-            --func_list[f_name]->sample_list[uid]->mem_leaks;
+/*
+    Helper function to complete the deferred entries of a chunk with the
+    spans open before it, kept by reader, then to pass on the spans it
+    started and ended. Chunks are resolved in the order of the log.
+*/
+static void resolve_chunk(log_reader & reader, const log_chunk & chunk, log_reader & chunk_reader, 
+ vector<log_entry> & entries) {
+    bool dropped = false;
+    for (const deferred_entry & d : chunk_reader.deferred) {
+        log_entry & entry = entries[d.index];
+        entry.deferred = false;
+        if (!reader.binary) {
+            auto it = reader.span_starts.find(d.name);
+            if (it != reader.span_starts.end()) {
+                entry.timestamp += it->second;
+                if (entry.type == FUNC_END) {
+                    reader.span_starts.erase(it);
+                }
+            }
+            continue;
         }
 
-        // RPC start
-        if (line_vect[2] == "RPC_start") {
-            func_list[f_name]->sample_list[uid]->RPC_start_time = stol(line_vect[0]);
+        auto it = reader.spans.find(d.span_id);
+        // Only its parent was looked up
+        if (entry.type == FUNC_START) {
+            if (it != reader.spans.end()) {
+                entry.parent_name = chunk_reader.func_names[get<0>(it->second)];
+                entry.parent_uid = get<1>(it->second);
+            }
+            continue;
+        }
+        if (it == reader.spans.end() && chunk_reader.lossy) {
+            // Its start was in a dropped batch
+            ++reader.skipped;
+            entry.deferred = dropped = true;
+            continue;
+        }
+        if (it == reader.spans.end()) {
+            cerr << "Error: incorrect log file format (unknown span)" << endl;
+            exit(EXIT_FAILURE);
+        }
+        entry.func_name = chunk_reader.func_names[get<0>(it->second)];
+        entry.uid = get<1>(it->second);
+        entry.rpc_id = get<2>(it->second);
+        entry.timestamp += get<3>(it->second);
+        if (entry.type == FUNC_END) {
+            reader.spans.erase(it);
+        }
+    }
+    if (dropped) {
+        size_t kept = 0;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (!entries[i].deferred) {
+                if (i != kept) {
+                    entries[kept] = move(entries[i]);
+                }
+                ++kept;
+            }
         }
+        entries.resize(kept);
+    }
+
+    if (chunk.new_capture) {
+        reader.spans.clear();
+        reader.span_starts.clear();
+    }
+    for (uint32_t span_id : chunk_reader.ended_spans) {
+        reader.spans.erase(span_id);
+    }
+    for (const string & name : chunk_reader.ended_names) {
+        reader.span_starts.erase(name);
+    }
+    for (const auto & span : chunk_reader.spans) {
+        reader.spans[span.first] = span.second;
+    }
+    for (const auto & span : chunk_reader.span_starts) {
+        reader.span_starts[span.first] = span.second;
+    }
+    reader.skipped += chunk_reader.skipped;
+}
 
-        // RPC end
-        if (line_vect[2] == "RPC_end") {
-            uint64_t server_time = calc_server_time(line_vect[3]);
-            func_list[f_name]->sample_list[uid]->server_time += server_time;
-            func_list[f_name]->sample_list[uid]->network_time += stol(line_vect[0]) - 
-                func_list[f_name]->sample_list[uid]->RPC_start_time - server_time;
+/*
+    Helper function to read the whole log on num_threads threads.
+    It is split into chunks, parsed in parallel a batch at a time,
+    then each batch is passed to consume, in the order of the log.
+*/
+template <typename Consume>
+static void read_log_chunks(log_reader & reader, const Consume & consume) {
+    uintmax_t total_size = 0;
+    for (const string & path : reader.segments) {
+        total_size += filesystem::file_size(path);
+    }
+    size_t chunk_size = min((uintmax_t)MAX_CHUNK_SIZE, max((uintmax_t)MIN_CHUNK_SIZE, 
+        total_size / (num_threads * CHUNKS_PER_THREAD)));
+    vector<pair<const char *, size_t>> files;
+    vector<log_chunk> chunks = split_log(reader, chunk_size, files);
+
+    size_t batch_size = num_threads * CHUNKS_PER_THREAD;
+    for (size_t first = 0; first < chunks.size(); first += batch_size) {
+        size_t n = min(batch_size, chunks.size() - first);
+        vector<log_reader> chunk_readers(n);
+        vector<vector<log_entry>> batch(n);
+        parallel_for(n, [&](size_t i) {
+            parse_chunk(reader, chunks[first + i], chunk_readers[i], batch[i]);
+        });
+        for (size_t i = 0; i < n; ++i) {
+            resolve_chunk(reader, chunks[first + i], chunk_readers[i], batch[i]);
+        }
+        consume(batch);
+    }
 
-            tuple<uint64_t, uint64_t> server_mem = calc_server_memory(line_vect[3]);
-            func_list[f_name]->sample_list[uid]->server_memory_usage += get<0>(server_mem);
-            func_list[f_name]->sample_list[uid]->server_mem_leaks += get<1>(server_mem);
+    for (const auto & file : files) {
+        if (file.first) {
+            munmap((void *)file.first, file.second);
+        }
+    }
+}
 
-            tuple<uint64_t, uint64_t> server_pagefaults = calc_server_pagefaults(line_vect[3]);
-            func_list[f_name]->sample_list[uid]->server_min_pagefault += get<0>(server_pagefaults);
-            func_list[f_name]->sample_list[uid]->server_maj_pagefault += get<1>(server_pagefaults);
+/*
+    Helper function to hand the entries of a batch to num_threads threads,
+    each one getting those of its shard (see shard_of, num_threads for none)
+    in the order of the log, along with their position in the batch.
+*/
+template <typename Shard_of, typename Consume>
+static void for_each_shard(const vector<vector<log_entry>> & batch, const Shard_of & shard_of, const Consume & consume) {
+    // Entries of each shard in each chunk
+    vector<vector<vector<uint32_t>>> shards(batch.size());
+    parallel_for(batch.size(), [&](size_t c) {
+        shards[c].resize(num_threads);
+        for (size_t i = 0; i < batch[c].size(); ++i) {
+            size_t shard = shard_of(batch[c][i]);
+            if (shard < num_threads) {
+                shards[c][shard].push_back(i);
+            }
         }
+    });
 
-        // Pagefault (minor and major)
-        if (line_vect[2] == "pagefault") {
-            func_list[f_name]->sample_list[uid]->min_pagefault += stoi(line_vect[3]);
-            func_list[f_name]->sample_list[uid]->maj_pagefault += stoi(line_vect[4]);
+    vector<uint64_t> offsets(batch.size(), 0);
+    for (size_t c = 1; c < batch.size(); ++c) {
+        offsets[c] = offsets[c - 1] + batch[c - 1].size();
+    }
+    parallel_for(num_threads, [&](size_t shard) {
+        for (size_t c = 0; c < batch.size(); ++c) {
+            for (uint32_t i : shards[c][shard]) {
+                consume(shard, batch[c][i], offsets[c] + i);
+            }
         }
+    });
+}
 
-        // Waiting time (lock)
-        if (line_vect[2] == "mutex_lock") {
-            func_list[f_name]->sample_list[uid]->waiting_time += stoi(line_vect[3]);
+/*
+    Helper function to add a server entry to what was logged for its RPC.
+*/
+static void add_server_entry(unordered_map<int64_t, server_rpc> & rpcs, const log_entry & entry) {
+    if (entry.rpc_id < 0) {
+        return;
+    }
+    // The first span of the RPC id, its later ones (if any) are ignored
+    if (entry.type == FUNC_START) {
+        if (rpcs.count(entry.rpc_id)) {
+            return;
         }
+        rpcs[entry.rpc_id].start_time = entry.timestamp;
+        return;
+    }
+    auto it = rpcs.find(entry.rpc_id);
+    if (it == rpcs.end() || it->second.ended) {
+        return;
+    }
+    server_rpc & rpc = it->second;
 
-        // Lock holding time
-        if (line_vect[2] == "mutex_unlock") {
-            func_list[f_name]->sample_list[uid]->lock_holding_time += stoi(line_vect[3]);
+    // When several are logged, the last one counts
+    switch (entry.type) {
+        case FUNC_END:
+            rpc.exec_time = entry.timestamp - rpc.start_time;
+            rpc.ended = true;
+            break;
+
+        case MEMORY:
+            copy(entry.args, entry.args + 4, rpc.memory);
+            break;
+
+        case PAGEFAULT:
+            copy(entry.args, entry.args + 2, rpc.pagefaults);
+            break;
+
+        case CPU_TIME:
+            copy(entry.args, entry.args + 3, rpc.cpu);
+            break;
+
+        case CONTEXT_SWITCHES:
+            copy(entry.args, entry.args + 2, rpc.cpu + 3);
+            break;
+
+        case RPC_TIMES:
+            rpc.queue_time = entry.args[0];
+            rpc.handler_time = entry.args[1];
+            break;
+
+        case PERF_HW:
+            rpc.has_hw_counters = true;
+            copy(entry.args, entry.args + 4, rpc.hw_counters);
+            break;
+
+        case PERF_SW:
+            rpc.has_sw_counters = true;
+            copy(entry.args, entry.args + 4, rpc.sw_counters);
+            break;
+
+        default:
+            break;
+    }
+}
+
+/* 
+    Helper function to parse the server logs
+    once, aggregating what they logged for each RPC
+    so that the client side can look it up.
+*/
+void preprocess_server_log() {
+    // RPC ids are unique across processes, so all the logs go to the same RPCs
+    vector<unordered_map<int64_t, server_rpc>> shards(num_threads);
+    for (const string & path : find_logs(server)) {
+        log_reader server_log;
+        open_log(server_log, path);
+
+        if (num_threads > 1) {
+            // Each thread aggregates the RPC ids of its shard
+            read_log_chunks(server_log, [&](vector<vector<log_entry>> & batch) {
+                for_each_shard(batch, [](const log_entry & entry) {
+                    return entry.rpc_id < 0 ? num_threads : (size_t)entry.rpc_id % num_threads;
+                }, [&](size_t shard, const log_entry & entry, uint64_t) {
+                    add_server_entry(shards[shard], entry);
+                });
+            });
+        } else {
+            log_entry entry;
+            while (read_entry(server_log, entry)) {
+                add_server_entry(server_rpcs, entry);
+            }
         }
+        report_skipped(server_log, server);
 
-        // Waiting time (cond_wait)
-        if (line_vect[2] == "cond_wait_returned") {
-            func_list[f_name]->sample_list[uid]->waiting_time += stoi(line_vect[3]);
+        close_log(server_log);
+    }
+    for (auto & shard : shards) {
+        server_rpcs.merge(shard);
+    }
+}
+
+/*
+    Helper function to add an entry of the given client log to the
+    run it belongs to, creating the run on FUNC_START. Returns the run,
+    or nullptr if its FUNC_START was not read, for the caller to skip.
+*/
+static sample * add_client_entry(unordered_map<string, custom_func *> & func_list, const log_entry & entry, 
+ size_t log, vector<string_view> & params) {
+    // Sample uid and func name
+    // (e.g do_stuff1 is the first run of do_stuff).
+    uint32_t uid = entry.uid;
+    const string & f_name = entry.func_name;
+    run_key key(log, entry.process_tag, uid);
+
+    if (entry.type == FUNC_START) {
+        vector<feature*> feature_list;
+        if (!entry.text.empty()) {
+            split_tokens(entry.text, params);
+            for (string_view param : params) {
+                // Format: e.g. asd=int&12
+                size_t equal = param.find('=');
+                size_t amp = param.find('&');
+                feature_list.push_back(make_feature(string(param.substr(0, equal)), 
+                    string(param.substr(equal + 1, amp - equal - 1)), string(param.substr(amp + 1))));
+            }
         }
+        
+        // Per-thread log buffers do not preserve the order of
+        // runs across threads, so uid 1 is not necessarily first
+        if (func_list.find(f_name) == func_list.end()) {
+            // First run of the function, create structs
+            func_list[f_name] = make_custom_func(f_name);
+        }
+        func_list[f_name]->sample_list[key] = make_sample(uid);
+        func_list[f_name]->sample_list[key]->feature_list = feature_list;
+        func_list[f_name]->sample_list[key]->start_time = entry.timestamp;
+        func_list[f_name]->sample_list[key]->weight = entry.weight;
+
+        // Nested run: the caller adds it to the children of its
+        // parent, which may belong to another thread (see --threads)
+        if (!entry.parent_name.empty()) {
+            func_list[f_name]->sample_list[key]->parent = entry.parent_name + to_string(entry.parent_uid);
+        }
+    }
+
+    auto f = func_list.find(f_name);
+    if (f == func_list.end()) {
+        return nullptr;
+    }
+    auto it = f->second->sample_list.find(key);
+    if (it == f->second->sample_list.end()) {
+        return nullptr;
+    }
+    sample * s = it->second;
+
+    switch (entry.type) {
+        // Memory allocated, freed, still live and peak
+        case MEMORY:
+            s->memory_usage += entry.args[0];
+            s->freed_memory += entry.args[1];
+            s->mem_leaks += entry.args[2];
+            s->peak_memory = max(s->peak_memory, entry.args[3]);
+            break;
+
+        case RPC_START:
+            s->RPC_start_time = entry.timestamp;
+            break;
 
-        // Waiting time (cond_timedwait)
-        if (line_vect[2] == "cond_timedwait_returned") {
-            func_list[f_name]->sample_list[uid]->waiting_time += stoi(line_vect[3]);
+        case RPC_END: {
+            // Not there if the server did not record it (sampling)
+            auto it = server_rpcs.find(entry.args[0]);
+            if (it == server_rpcs.end()) {
+                s->network_time += entry.timestamp - s->RPC_start_time;
+                break;
+            }
+            const server_rpc & rpc = it->second;
+            s->server_time += rpc.exec_time;
+            uint64_t rpc_time = entry.timestamp - s->RPC_start_time;
+            // Clocks of different processes are truncated differently,
+            // so the server time might slightly exceed the RPC one
+            s->network_time += rpc_time > rpc.exec_time ? rpc_time - rpc.exec_time : 0;
+
+            s->server_memory_usage += rpc.memory[0];
+            s->server_freed_memory += rpc.memory[1];
+            s->server_mem_leaks += rpc.memory[2];
+            s->server_peak_memory = max(s->server_peak_memory, rpc.memory[3]);
+
+            s->server_min_pagefault += rpc.pagefaults[0];
+            s->server_maj_pagefault += rpc.pagefaults[1];
+
+            s->server_cpu_time += rpc.cpu[0];
+            s->server_user_time += rpc.cpu[1];
+            s->server_system_time += rpc.cpu[2];
+            s->server_voluntary_switches += rpc.cpu[3];
+            s->server_involuntary_switches += rpc.cpu[4];
+
+            s->server_queue_time += rpc.queue_time;
+            s->server_handler_time += rpc.handler_time;
+
+            if (rpc.has_hw_counters) {
+                s->has_hw_counters = true;
+                s->server_cycles += rpc.hw_counters[0];
+                s->server_instructions += rpc.hw_counters[1];
+                s->server_cache_misses += rpc.hw_counters[2];
+                s->server_branch_misses += rpc.hw_counters[3];
+            }
+            if (rpc.has_sw_counters) {
+                s->has_sw_counters = true;
+                s->server_task_clock += rpc.sw_counters[0];
+                s->server_context_switches += rpc.sw_counters[1];
+                s->server_cpu_migrations += rpc.sw_counters[2];
+            }
+            break;
         }
 
+        // Cycles, instructions, cache misses and branch misses
+        case PERF_HW:
+            s->has_hw_counters = true;
+            s->cycles += entry.args[0];
+            s->instructions += entry.args[1];
+            s->cache_misses += entry.args[2];
+            s->branch_misses += entry.args[3];
+            break;
+
+        // Task clock, context switches and CPU migrations
+        case PERF_SW:
+            s->has_sw_counters = true;
+            s->task_clock += entry.args[0];
+            s->context_switches += entry.args[1];
+            s->cpu_migrations += entry.args[2];
+            break;
+
+        // Status code, request and response bytes of an RPC
+        case RPC_STATUS:
+            ++s->rpcs;
+            s->failed_rpcs += entry.args[0] != 0;
+            s->request_bytes += entry.args[1];
+            s->response_bytes += entry.args[2];
+            break;
+
+        // Pagefault (minor and major)
+        case PAGEFAULT:
+            s->min_pagefault += entry.args[0];
+            s->maj_pagefault += entry.args[1];
+            break;
+
+        // CPU time (total, user and system)
+        case CPU_TIME:
+            s->cpu_time += entry.args[0];
+            s->user_time += entry.args[1];
+            s->system_time += entry.args[2];
+            break;
+
+        // Context switches (voluntary and involuntary)
+        case CONTEXT_SWITCHES:
+            s->voluntary_switches += entry.args[0];
+            s->involuntary_switches += entry.args[1];
+            break;
+
+        // Waiting time (lock, cond_wait and cond_timedwait)
+        case MUTEX_LOCK:
+        case COND_WAIT_RETURNED:
+        case COND_TIMEDWAIT_RETURNED:
+            s->waiting_time += entry.args[0];
+            break;
+
+        // Lock holding time
+        case MUTEX_UNLOCK:
+            s->lock_holding_time += entry.args[0];
+            break;
+
         // Function end - done
-        if (line_vect[2] == "FUNC_END") {
-            func_list[f_name]->sample_list[uid]->exec_time = stol(line_vect[0]) - 
-                func_list[f_name]->sample_list[uid]->start_time;
+        case FUNC_END:
+            s->exec_time = entry.timestamp - s->start_time;
+            break;
+
+        default:
+            break;
+    }
+    return s;
+}
+
+/*
+    Helper function to pick the thread that aggregates the run, see --threads.
+*/
+static size_t client_shard_of(const string & f_name, const run_key & key) {
+    return (hash<string>()(f_name) + ((uint64_t)key.log << 32 | key.uid) + key.process_tag) % num_threads;
+}
+
+/*
+    Helper function to aggregate the runs of the given client log on
+    num_threads threads, each one taking the runs of its shard the same
+    way as the serial loop of generate_perf_trace, see merge_client_shards.
+    position counts the entries of the logs read so far.
+    Returns the type of the last entry of the log.
+*/
+static event_type aggregate_client_chunks(log_reader & client_log, size_t log, vector<client_shard> & shards, 
+ uint64_t & position) {
+    // Features of the current run of each thread
+    vector<vector<string_view>> params(num_threads);
+    event_type last_type = USER_EVENT;
+
+    read_log_chunks(client_log, [&](vector<vector<log_entry>> & batch) {
+        for_each_shard(batch, [&](const log_entry & entry) {
+            return client_shard_of(entry.func_name, run_key(log, entry.process_tag, entry.uid));
+        }, [&](size_t t, const log_entry & entry, uint64_t batch_position) {
+            client_shard & shard = shards[t];
+            uint64_t entry_position = position + batch_position;
+            if (entry.type == FUNC_START && !shard.func_list.count(entry.func_name)) {
+                shard.first_runs[entry.func_name] = entry_position;
+            }
+            sample * s = add_client_entry(shard.func_list, entry, log, params[t]);
+            if (!s) {
+                ++shard.skipped;
+            } else if (entry.type == FUNC_START) {
+                shard.run_starts[s] = entry_position;
+                if (!entry.parent_name.empty()) {
+                    shard.nested_runs.emplace_back(entry_position, entry.parent_name, 
+                        run_key(log, entry.process_tag, entry.parent_uid), 
+                        entry.func_name + to_string(entry.uid));
+                }
+            }
+        });
+        for (const auto & chunk : batch) {
+            position += chunk.size();
+            if (!chunk.empty()) {
+                last_type = chunk.back().type;
+            }
         }
+    });
+    for (auto & shard : shards) {
+        client_log.skipped += shard.skipped;
+        shard.skipped = 0;
     }
 
-    if (line_vect[2] == "FUNC_END") {
-        cout << "Trace generation successful\n" << endl;
-    } else {
-        cerr << "Error: incorrect log file format (no end)" << endl;
+    return last_type;
+}
+
+/*
+    Helper function to gather the runs aggregated by the threads into
+    func_list, as the serial loop of generate_perf_trace would have.
+*/
+static void merge_client_shards(vector<client_shard> & shards, unordered_map<string, custom_func *> & func_list) {
+    // Functions are added in the order of their first run, like the serial loop
+    // does, so that they are listed in the same order
+    unordered_map<string, uint64_t> first_runs;
+    for (const client_shard & shard : shards) {
+        for (const auto & f : shard.first_runs) {
+            auto it = first_runs.find(f.first);
+            if (it == first_runs.end() || f.second < it->second) {
+                first_runs[f.first] = f.second;
+            }
+        }
+    }
+    map<uint64_t, string> functions;
+    for (const auto & f : first_runs) {
+        functions[f.second] = f.first;
+    }
+    for (const auto & f : functions) {
+        func_list[f.second] = make_custom_func(f.second);
+    }
+    for (client_shard & shard : shards) {
+        for (const auto & f : shard.func_list) {
+            func_list[f.first]->sample_list.merge(f.second->sample_list);
+            delete f.second;
+        }
+    }
+
+    // Link nested runs in the order they started, to the run of their
+    // parent that was current then, if it is the one that was kept
+    map<uint64_t, const tuple<uint64_t, string, run_key, string> *> nested_runs;
+    for (const client_shard & shard : shards) {
+        for (const auto & run : shard.nested_runs) {
+            nested_runs[get<0>(run)] = &run;
+        }
+    }
+    for (const auto & nested : nested_runs) {
+        const auto & run = *nested.second;
+        auto p = func_list.find(get<1>(run));
+        if (p == func_list.end()) {
+            continue;
+        }
+        auto parent = p->second->sample_list.find(get<2>(run));
+        if (parent == p->second->sample_list.end()) {
+            continue;
+        }
+        const client_shard & owner = shards[client_shard_of(get<1>(run), get<2>(run))];
+        auto started = owner.run_starts.find(parent->second);
+        if (started != owner.run_starts.end() && started->second <= get<0>(run)) {
+            parent->second->children.push_back(get<3>(run));
+        }
+    }
+}
+
+void generate_perf_trace() {
+    ofstream trace_log;
+
+    vector<string> client_logs = find_logs(client);
+    trace_log.open(TRACE_LOGFILE);
+
+    if (!trace_log.is_open()) {
+        cerr << "Error: cannot write trace log" << endl;
         exit(EXIT_FAILURE);
     }
 
+    preprocess_server_log();
+
+    unordered_map<string, custom_func *> func_list;
+    vector<client_shard> shards(num_threads);
+    uint64_t position = 0;
+    // Of the first client log
+    Time_unit time_unit = unit_ms;
+
+    for (size_t log = 0; log < client_logs.size(); ++log) {
+        log_reader client_log;
+        open_log(client_log, client_logs[log]);
+        event_type last_type = USER_EVENT;
+
+        if (num_threads > 1) {
+            last_type = aggregate_client_chunks(client_log, log, shards, position);
+        } else {
+            log_entry entry;
+            // Features of the current run, as views of its entry
+            vector<string_view> params;
+
+            // Get the client log entry by entry
+            while (read_entry(client_log, entry)) {
+                if (!add_client_entry(func_list, entry, log, params)) {
+                    ++client_log.skipped;
+                }
+
+                // Link nested runs, the parent started before on the same thread
+                if (entry.type == FUNC_START && !entry.parent_name.empty()) {
+                    auto p = func_list.find(entry.parent_name);
+                    run_key parent_key(log, entry.process_tag, entry.parent_uid);
+                    if (p != func_list.end() && p->second->sample_list.count(parent_key)) {
+                        p->second->sample_list[parent_key]->children.push_back(entry.func_name + to_string(entry.uid));
+                    }
+                }
+                last_type = entry.type;
+            }
+        }
+
+        report_skipped(client_log, client);
+        if (last_type != FUNC_END) {
+            cerr << "Error: incorrect log file format (no end)" << endl;
+            exit(EXIT_FAILURE);
+        }
+        if (log == 0) {
+            time_unit = client_log.time_unit;
+        }
+        close_log(client_log);
+    }
+    if (num_threads > 1) {
+        merge_client_shards(shards, func_list);
+    }
+    cout << "Trace generation successful\n" << endl;
+
+    // Report the times in the unit of the (first) client log
     for (const auto& f : func_list) {
         cout << f.second->name << endl;
         trace_log << f.second->name << endl;
+
+        // Sampled runs stand for the ones that were not recorded
+        uint64_t tot_runs = 0;
         for (const auto& s : f.second->sample_list) {
-            cout << "Run #" << s.second->uid << endl;
-            trace_log << "Run #" << s.second->uid << endl;
-            cout << s.second->print() << "\n" << endl;
-            trace_log << s.second->print() << "\n" << endl;
+            tot_runs += s.second->weight;
+        }
+        if (tot_runs > f.second->sample_list.size()) {
+            cout << "Estimated " << tot_runs << " runs from " << f.second->sample_list.size() << " samples\n" << endl;
+            trace_log << "Estimated " << tot_runs << " runs from " << f.second->sample_list.size() << " samples\n" << endl;
+        }
+        for (const auto& s : f.second->sample_list) {
+            s.second->scale_times(time_unit);
+            // Runs of different client processes may have the same uid
+            string run = "Run #" + to_string(s.second->uid);
+            if (client_logs.size() > 1) {
+                run += " (" + client_logs[s.first.log] + ")";
+            }
+            cout << run << endl;
+            trace_log << run << endl;
+            cout << s.second->print(time_unit) << "\n" << endl;
+            trace_log << s.second->print(time_unit) << "\n" << endl;
         }
     }
 
     encode_perf_trace(func_list);
 
-    client_log.close();
     trace_log.close();
 }
 
-void encode_perf_trace(unordered_map<string, custom_func *> func_list) {
-    for (const auto& f : func_list) {
-        string rtn_name = f.second->name;
-        time_t now = time(NULL);
-        stringstream now_ss;
-        now_ss.str("");
-        mkdir("symbols/", S_IRWXU | S_IRWXG);
-        string folder = "symbols/" + rtn_name;
-        now_ss << folder << "/idcm_" << rtn_name << "_" << now << ".bin";
+/*
+    Helper function to create the Freud file of a function, in symbols/.
+*/
+static ofstream open_freud_file(const string & rtn_name, string & path) {
+    time_t now = time(NULL);
+    stringstream now_ss;
+    now_ss.str("");
+    mkdir("symbols/", S_IRWXU | S_IRWXG);
+    string folder = "symbols/" + rtn_name;
+    now_ss << folder << "/idcm_" << rtn_name << "_" << now << ".bin";
+    path = now_ss.str();
+
+    mkdir(folder.c_str(), S_IRWXU | S_IRWXG);
+    ofstream out_file(path.c_str(), ios::binary);
+    if (!out_file.is_open()) {
+        cerr << "Error: cannot open " << path << endl;
+        exit(EXIT_FAILURE);
+    }
+    return out_file;
+}
 
-        mkdir(folder.c_str(), S_IRWXU | S_IRWXG);
-        ofstream out_file(now_ss.str().c_str(), ios::binary);
-        if (!out_file.is_open()) {
-            cerr << "Error: cannot open " << now_ss.str() << endl;
-            exit(EXIT_FAILURE);
-        }
+/*
+    Helper function to write the header of the Freud file of a function:
+    its name, then the names and types of its features, whose offsets
+    in the file the samples refer to.
+*/
+static void write_freud_header(ofstream & out_file, const string & rtn_name, const vector<string> & fnames, 
+ const set<string> & ftype_names, unordered_map<string, uint64_t> & fname_offsets, 
+ unordered_map<string, uint64_t> & ftype_offsets) {
+    // Function name
+    uint32_t name_len = rtn_name.size();
+    out_file.write((char *)&name_len, sizeof(uint32_t));
+    out_file.write(rtn_name.c_str(), sizeof(char) * name_len);
+
+    // Feature names
+    uint32_t tot_fnames = fnames.size();
+    out_file.write((char *)&tot_fnames, sizeof(uint32_t));
+    for (const string & fname : fnames) {
+        fname_offsets.insert(make_pair(fname, out_file.tellp()));
+        uint16_t fname_len = fname.size();
+        out_file.write((char *)&fname_len, sizeof(uint16_t));
+        out_file.write(fname.c_str(), sizeof(char) * fname_len);
+    }
 
-        // Function name
-        uint32_t name_len = rtn_name.size();
-        out_file.write((char *)&name_len, sizeof(uint32_t));
-        out_file.write(rtn_name.c_str(), sizeof(char) * name_len);
+    // (No system variables)
 
-        // Feature names
-        unordered_map<string, uint64_t> fname_offsets;
-		unordered_map<string, uint64_t> ftype_offsets;
-		set<string> ftype_names;
-		uint32_t tot_fnames = 0;
-		fpos<mbstate_t> tot_fnames_position = out_file.tellp();
-		out_file.write((char *)&tot_fnames, sizeof(uint32_t));
+    // Type names
+    uint32_t tcount = ftype_names.size();
+    out_file.write((char *)&tcount, sizeof(uint32_t));
+    for (string t: ftype_names) {
+        ftype_offsets.insert(make_pair(t, out_file.tellp()));
+        uint16_t ftype_len = t.size();
+        out_file.write((char *)&ftype_len, sizeof(uint16_t));
+        out_file.write(t.c_str(), sizeof(char) * ftype_len);
+    }
+}
+
+/*
+    Helper function to get the metrics of a sample as written to
+    Freud: its time, the memory, lock holding and waiting time and
+    minor and major pagefaults of client and server. Freud has no
+    field for the performance counters, which are only in the trace.
+*/
+static void freud_metrics(const sample * s, uint64_t metrics[6]) {
+    uint64_t values[] = {
+        s->exec_time,
+        s->memory_usage + s->server_memory_usage,
+        s->server_lock_holding_time + s->lock_holding_time,
+        s->server_waiting_time + s->waiting_time,
+        s->server_min_pagefault + s->min_pagefault,
+        s->server_maj_pagefault + s->maj_pagefault
+    };
+    copy(values, values + 6, metrics);
+}
+
+/*
+    Helper function to get the value of a feature as written to Freud.
+*/
+static int64_t freud_value(const feature * feat, const string & rtn_name) {
+    // We should have only primitives
+    // ...skipping some checks...
+    if (feat->type == "double") {
+        return stod(feat->value);
+    } else if (feat->type == "int") {
+        return stoi(feat->value);
+    } else if (feat->type == "float") {
+        return stof(feat->value);
+    } else if (feat->type == "long") {
+        return stoll(feat->value);
+    }
+    cerr << "Error: unknown feature type (" << feat->type << ") for " << rtn_name << endl;
+    exit(EXIT_FAILURE);
+}
+
+/*
+    Helper function to write a sample to the Freud file of its function:
+    its uid and metrics (see freud_metrics), then the offsets of the name
+    and type of each feature (see write_freud_header) with its value.
+*/
+static void write_freud_sample(ofstream & out_file, uint32_t uid, const uint64_t metrics[6], 
+ const vector<tuple<uint64_t, uint64_t, int64_t>> & features) {
+    out_file.write((char *)&uid, sizeof(uint32_t));
+    out_file.write((char *)metrics, 6 * sizeof(uint64_t));
+
+    // Num of features, local and global ones
+    uint32_t tot_features = features.size();
+    out_file.write((char *)&tot_features, sizeof(uint32_t));
+    for (const auto & feat : features) {
+        out_file.write((char *)&get<0>(feat), sizeof(uint64_t));
+        out_file.write((char *)&get<1>(feat), sizeof(uint64_t));
+        out_file.write((char *)&get<2>(feat), sizeof(int64_t));
+    }
+
+    // System features (not used)
 
+    // Branches (not used)
+    uint32_t num_of_branches = 0;
+    out_file.write((char *)&num_of_branches, sizeof(uint32_t));
+
+    // Children (not used)
+    uint32_t num_of_children = 0;
+    out_file.write((char *)&num_of_children, sizeof(uint32_t));
+}
+
+void encode_perf_trace(unordered_map<string, custom_func *> func_list) {
+    for (const auto& f : func_list) {
+        string rtn_name = f.second->name;
+        string path;
+        ofstream out_file = open_freud_file(rtn_name, path);
+
+        // Feature names, in the order they are first found, and types
+        vector<string> fnames;
+        set<string> fname_set;
+        set<string> ftype_names;
         for (const auto& s : f.second->sample_list) {
             for (feature* pf: s.second->feature_list) {
-                string fname = pf->name;
-                if (fname_offsets.find(fname) == fname_offsets.end()) {
-                    fname_offsets.insert(make_pair(fname, out_file.tellp()));
+                if (fname_set.insert(pf->name).second) {
+                    fnames.push_back(pf->name);
                     ftype_names.insert(pf->type);
-                    uint16_t fname_len = fname.size();
-                    out_file.write((char *)&fname_len, sizeof(uint16_t));
-                    out_file.write(fname.c_str(), sizeof(char) * fname_len);
-                    tot_fnames++;
                 }
             }
         }
+        unordered_map<string, uint64_t> fname_offsets;
+        unordered_map<string, uint64_t> ftype_offsets;
+        write_freud_header(out_file, rtn_name, fnames, ftype_names, fname_offsets, ftype_offsets);
 
-        // (No system variables)
-
-        // Type names
-        uint32_t tcount = ftype_names.size();
-		out_file.write((char *)&tcount, sizeof(uint32_t));
-		for (string t: ftype_names) {
-			ftype_offsets.insert(make_pair(t, out_file.tellp()));
-			uint16_t ftype_len = t.size();
-			out_file.write((char *)&ftype_len, sizeof(uint16_t));
-			out_file.write(t.c_str(), sizeof(char) * ftype_len);
-		}
-
-        // Go back and write the correct number of features
-        fpos<mbstate_t> prev_pos = out_file.tellp();
-		out_file.seekp(tot_fnames_position);
-		out_file.write((char *)&tot_fnames, sizeof(uint32_t));
-		out_file.seekp(prev_pos);
+        // Weigh the samples relative to the most sampled ones,
+        // so that equally sampled runs are written once
+        uint32_t min_weight = UINT32_MAX;
+        for (const auto& s : f.second->sample_list) {
+            min_weight = min(min_weight, s.second->weight);
+        }
+        auto copies = [&](const sample * s) {
+            return (s->weight + min_weight / 2) / min_weight;
+        };
 
         // Number of samples
-        uint32_t samples_count = f.second->sample_list.size();
-        fpos<mbstate_t> num_of_samples_position = out_file.tellp();
-		out_file.write((char *)&samples_count, sizeof(uint32_t));
+        uint32_t samples_count = 0;
+        for (const auto& s : f.second->sample_list) {
+            samples_count += copies(s.second);
+        }
+        out_file.write((char *)&samples_count, sizeof(uint32_t));
 
         // Uid and metrics
         for (const auto& s : f.second->sample_list) {
-            uint64_t tot_mem = s.second->memory_usage + s.second->server_memory_usage;
-            uint64_t tot_lock_holding_time = s.second->server_lock_holding_time + s.second->lock_holding_time;
-            uint64_t tot_waiting_time = s.second->server_waiting_time + s.second->waiting_time;
-            uint64_t tot_min_faults = s.second->server_min_pagefault + s.second->min_pagefault;
-            uint64_t tot_maj_faults = s.second->server_maj_pagefault + s.second->maj_pagefault;
-            out_file.write((char *)&s.second->uid, sizeof(uint32_t));
-            out_file.write((char *)&s.second->exec_time, sizeof(uint64_t));
-            out_file.write((char *)&tot_mem, sizeof(uint64_t));
-            out_file.write((char *)&tot_lock_holding_time, sizeof(uint64_t));
-            out_file.write((char *)&tot_waiting_time, sizeof(uint64_t));
-            out_file.write((char *)&tot_min_faults, sizeof(uint64_t));
-            out_file.write((char *)&tot_maj_faults, sizeof(uint64_t));
-            
-
-            // Num of features
-            uint32_t pn = 0, tot_features = 0;
-            fpos<mbstate_t> tf_pos = out_file.tellp();
-            out_file.write((char *)&tot_features, sizeof(uint32_t));
-            uint32_t rot_idx = 0;
-            string runtime_type;
-
-            // Local and global features
+            uint64_t metrics[6];
+            freud_metrics(s.second, metrics);
+            vector<tuple<uint64_t, uint64_t, int64_t>> features;
             for (auto feat : s.second->feature_list) {
-                // We should have only primitives
-                runtime_type = "0";
-
-                // ...skipping some checks...
-
-                uint64_t offs = fname_offsets[feat->name];
-                uint64_t toffs = ftype_offsets[feat->type];
-                out_file.write((char *)&offs, sizeof(uint64_t));
-                out_file.write((char *)&toffs, sizeof(uint64_t));
-                int64_t v;
-                if (feat->type == "double") {
-                    v = stod(feat->value);
-                } else if (feat->type == "int") {
-                    v = stoi(feat->value);
-                } else if (feat->type == "float") {
-                    v = stof(feat->value);
-                } else if (feat->type == "long") {
-                    v = stol(feat->value);
-                } else {
-                    cerr << "Error: unknown feature type (" << feat->type << ") for " << rtn_name << endl;
-                    exit(EXIT_FAILURE);
-                }
-                out_file.write((char *)&v, sizeof(int64_t));
-                ++tot_features;
+                features.emplace_back(fname_offsets[feat->name], ftype_offsets[feat->type], freud_value(feat, rtn_name));
             }
-
-            if (tot_features != s.second->feature_list.size()) {
-                cerr << "Error: features amount mismatch for " << rtn_name << endl;
-                exit(EXIT_FAILURE);
+            for (uint32_t copy = 0; copy < copies(s.second); ++copy) {
+                write_freud_sample(out_file, s.second->uid, metrics, features);
             }
+        }
+
+        out_file.close();
+    }
+}
 
-            // System features (not used)
-            prev_pos = out_file.tellp();
-            out_file.seekp(tf_pos);
-            out_file.write((char *)&tot_features, sizeof(uint32_t));
-            out_file.seekp(prev_pos);
+/*
+    Helper function to open the client logs, then the server ones.
+*/
+static vector<log_stream> open_streams(const vector<string> & client_logs, const vector<string> & server_logs) {
+    vector<log_stream> streams(client_logs.size() + server_logs.size());
+    for (size_t i = 0; i < streams.size(); ++i) {
+        log_stream & stream = streams[i];
+        stream.side = i < client_logs.size() ? client : server;
+        stream.index = stream.side == client ? i : i - client_logs.size();
+        open_log(stream.reader, stream.side == client ? client_logs[stream.index] : server_logs[stream.index]);
+    }
+    return streams;
+}
 
-            // Branches (not used)
-            uint32_t num_of_branches = 0;
-            out_file.write((char *)&num_of_branches, sizeof(uint32_t));
+/*
+    Helper function to read the entries of all the logs in the order of
+    their wall-clock time, passing them to consume. An entry is passed
+    once all the logs have been read up to merge_window after it, or to
+    their end. origin is set to the earliest time base of the logs
+    before the first entry, the logs without one starting there.
+    Closes the logs.
+*/
+template <typename Consume>
+static void merge_streams(vector<log_stream> & streams, uint64_t & origin, const Consume & consume) {
+    // The time base of a log is known once its header is read
+    vector<pair<size_t, log_entry>> first_entries;
+    for (size_t i = 0; i < streams.size(); ++i) {
+        log_entry entry;
+        if (read_entry(streams[i].reader, entry)) {
+            first_entries.emplace_back(i, move(entry));
+        }
+    }
+    origin = UINT64_MAX;
+    for (const log_stream & stream : streams) {
+        if (stream.reader.time_base != 0) {
+            origin = min(origin, stream.reader.time_base);
+        }
+    }
+    origin = origin == UINT64_MAX ? 0 : origin;
+
+    // Entries read but not passed yet, the earliest first
+    priority_queue<pending_entry, vector<pending_entry>, greater<pending_entry>> pending;
+    // Logs left to read, the one read up to the earliest time first
+    priority_queue<pair<uint64_t, size_t>, vector<pair<uint64_t, size_t>>, greater<pair<uint64_t, size_t>>> active;
+    uint64_t seq = 0;
+    auto add_pending = [&](size_t i, log_entry & entry) {
+        log_stream & stream = streams[i];
+        uint64_t time = (stream.reader.time_base ? stream.reader.time_base : origin) + entry.timestamp;
+        stream.watermark = max(stream.watermark, time);
+        pending.push({time, i, seq++, move(entry)});
+    };
+    for (auto & first : first_entries) {
+        add_pending(first.first, first.second);
+        active.emplace(streams[first.first].watermark, first.first);
+    }
+    first_entries.clear();
+
+    uint64_t window = merge_window * 1000000;
+    uint64_t last_time = 0;
+    uint64_t late = 0;
+    log_entry entry;
+    while (!pending.empty()) {
+        if (!active.empty()) {
+            size_t i = active.top().second;
+            active.pop();
+            if (read_entry(streams[i].reader, entry)) {
+                add_pending(i, entry);
+                active.emplace(streams[i].watermark, i);
+            }
+        }
 
-            // Children (not used)
-            uint32_t num_of_children = 0;
-            out_file.write((char *)&num_of_children, sizeof(uint32_t));
+        // No log can have an earlier entry left
+        while (!pending.empty() && (active.empty() || pending.top().time + window <= active.top().first)) {
+            const pending_entry & next = pending.top();
+            late += next.time < last_time;
+            last_time = max(last_time, next.time);
+            consume(next);
+            pending.pop();
         }
+    }
 
-        // prev_pos = out_file.tellp();
-		// out_file.seekp(num_of_samples_position);
-		// out_file.write((char *)&samples_count, sizeof(uint32_t));
-		// out_file.seekp(prev_pos);
-        out_file.close();
+    for (log_stream & stream : streams) {
+        report_skipped(stream.reader, stream.side);
+        close_log(stream.reader);
+    }
+    if (late > 0) {
+        cout << "Warning: " << late << " entries came more than " << merge_window 
+            << " ms late in their log and are out of order, see --window" << endl;
     }
 }
 
 void simple_merge() {
-    ifstream client_log;
-    ifstream server_log;
     ofstream merged_log;
 
-    client_log.open(CLIENT_LOGFILE);
-    server_log.open(SERVER_LOGFILE);
+    vector<string> client_logs = find_logs(client);
+    vector<string> server_logs = find_logs(server);
     merged_log.open(MERGED_LOGFILE);
 
-    if (!client_log.is_open()) {
-        cerr << "Error: cannot open client log" << endl;
+    if (!merged_log.is_open()) {
+        cerr << "Error: cannot write merged log" << endl;
         exit(EXIT_FAILURE);
     }
 
-    if (!server_log.is_open()) {
-        cerr << "Error: cannot open server log" << endl;
-        exit(EXIT_FAILURE);
+    vector<log_stream> streams = open_streams(client_logs, server_logs);
+    vector<string> tags(streams.size());
+    for (size_t i = 0; i < streams.size(); ++i) {
+        const log_stream & stream = streams[i];
+        const vector<string> & logs = stream.side == client ? client_logs : server_logs;
+        // Server entries are tagged, and so are the logs of a side that has several
+        if (logs.size() > 1) {
+            tags[i] = (stream.side == client ? " [client " : " [server ") + to_string(stream.index + 1) + "]";
+            merged_log << "#" << tags[i] << " " << logs[stream.index] << endl;
+        } else if (stream.side == server) {
+            tags[i] = " [server]";
+        }
     }
 
-    if (!merged_log.is_open()) {
-        cerr << "Error: cannot write merged log" << endl;
+    uint64_t origin = 0;
+    merge_streams(streams, origin, [&](const pending_entry & next) {
+        log_entry & merged = next.entry;
+        merged.timestamp = next.time > origin ? next.time - origin : 0;
+        merged_log << format_entry(merged) + tags[next.stream] << endl;
+    });
+    cout << "Simple merge completed successfully" << endl;
+
+    merged_log.close();
+}
+
+/*
+    Helper function to write a run that ended to the trace log and to
+    the spool of its function (see freud_spool), then to free it.
+*/
+static void write_run(custom_func * f, const run_key & key, unordered_map<string, freud_spool> & spools, 
+ Time_unit time_unit, const vector<string> & client_logs, ofstream & trace_log) {
+    auto it = f->sample_list.find(key);
+    sample * s = it->second;
+    s->scale_times(time_unit);
+    string run = f->name + " Run #" + to_string(s->uid);
+    if (client_logs.size() > 1) {
+        run += " (" + client_logs[key.log] + ")";
+    }
+    cout << run << endl;
+    trace_log << run << endl;
+    cout << s->print(time_unit) << "\n" << endl;
+    trace_log << s->print(time_unit) << "\n" << endl;
+
+    freud_spool & spool = spools[f->name];
+    if (!spool.spool.is_open()) {
+        mkdir("symbols/", S_IRWXU | S_IRWXG);
+        string folder = "symbols/" + f->name;
+        mkdir(folder.c_str(), S_IRWXU | S_IRWXG);
+        spool.spool_path = folder + "/samples.spool";
+        spool.spool.open(spool.spool_path, ios::binary);
+        if (!spool.spool.is_open()) {
+            cerr << "Error: cannot open " << spool.spool_path << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Same as the Freud sample, with the ids of the feature names and types
+    uint64_t metrics[6];
+    freud_metrics(s, metrics);
+    uint32_t tot_features = s->feature_list.size();
+    spool.spool.write((char *)&s->uid, sizeof(uint32_t));
+    spool.spool.write((char *)&s->weight, sizeof(uint32_t));
+    spool.spool.write((char *)metrics, sizeof(metrics));
+    spool.spool.write((char *)&tot_features, sizeof(uint32_t));
+    for (feature * feat : s->feature_list) {
+        auto name = spool.fname_ids.emplace(feat->name, spool.fnames.size());
+        if (name.second) {
+            spool.fnames.push_back(feat->name);
+        }
+        auto type = spool.ftype_ids.emplace(feat->type, spool.ftypes.size());
+        if (type.second) {
+            spool.ftypes.push_back(feat->type);
+        }
+        int64_t v = freud_value(feat, f->name);
+        spool.spool.write((char *)&name.first->second, sizeof(uint32_t));
+        spool.spool.write((char *)&type.first->second, sizeof(uint32_t));
+        spool.spool.write((char *)&v, sizeof(int64_t));
+        delete feat;
+    }
+    ++spool.samples;
+    spool.tot_runs += s->weight;
+    spool.min_weight = min(spool.min_weight, s->weight);
+
+    delete s;
+    f->sample_list.erase(it);
+}
+
+/*
+    Helper function to write the Freud file of a function
+    from its spool (see freud_spool), like encode_perf_trace.
+*/
+static void write_freud_file(const string & rtn_name, freud_spool & spool) {
+    spool.spool.close();
+    string path;
+    ofstream out_file = open_freud_file(rtn_name, path);
+
+    set<string> ftype_names(spool.ftypes.begin(), spool.ftypes.end());
+    unordered_map<string, uint64_t> fname_offsets;
+    unordered_map<string, uint64_t> ftype_offsets;
+    write_freud_header(out_file, rtn_name, spool.fnames, ftype_names, fname_offsets, ftype_offsets);
+
+    auto copies = [&](uint32_t weight) {
+        return (weight + spool.min_weight / 2) / spool.min_weight;
+    };
+
+    // Read twice: to count the samples, then to write them
+    uint32_t samples_count = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+        ifstream in(spool.spool_path, ios::binary);
+        uint32_t uid, weight, tot_features;
+        uint64_t metrics[6];
+        vector<tuple<uint64_t, uint64_t, int64_t>> features;
+        while (in.read((char *)&uid, sizeof(uint32_t)) && in.read((char *)&weight, sizeof(uint32_t)) && 
+            in.read((char *)metrics, sizeof(metrics)) && in.read((char *)&tot_features, sizeof(uint32_t))) {
+            features.clear();
+            for (uint32_t i = 0; i < tot_features; ++i) {
+                uint32_t name, type;
+                int64_t v;
+                in.read((char *)&name, sizeof(uint32_t));
+                in.read((char *)&type, sizeof(uint32_t));
+                in.read((char *)&v, sizeof(int64_t));
+                features.emplace_back(fname_offsets[spool.fnames[name]], ftype_offsets[spool.ftypes[type]], v);
+            }
+            for (uint32_t copy = 0; copy < copies(weight); ++copy) {
+                if (pass == 0) {
+                    ++samples_count;
+                } else {
+                    write_freud_sample(out_file, uid, metrics, features);
+                }
+            }
+        }
+        if (pass == 0) {
+            // Number of samples
+            out_file.write((char *)&samples_count, sizeof(uint32_t));
+        }
+    }
+
+    out_file.close();
+    filesystem::remove(spool.spool_path);
+}
+
+void stream_perf_trace() {
+    ofstream trace_log;
+
+    vector<string> client_logs = find_logs(client);
+    vector<string> server_logs = find_logs(server);
+    trace_log.open(TRACE_LOGFILE);
+
+    if (!trace_log.is_open()) {
+        cerr << "Error: cannot write trace log" << endl;
         exit(EXIT_FAILURE);
     }
 
-    string line;
-    string tmp_line;
-    while(getline(client_log, line)) {
-        tmp_line = line;
-        // If RPC request, add server data
-        if (line.find("RPC_end") != string::npos) {
-            string RPC_id = line.substr(line.find("RPC_end ") + 8);
-            getline(server_log, line);
-            while (line.find(" " + RPC_id + " FUNC_END") == string::npos) {
-                merged_log << line + " [server]" << endl;
-                getline(server_log, line);
+    // The client logs come first, see open_streams
+    vector<log_stream> streams = open_streams(client_logs, server_logs);
+    const log_reader & first_client_log = streams[0].reader;
+
+    unordered_map<string, custom_func *> func_list;
+    unordered_map<string, freud_spool> spools;
+    // Server RPCs that ended and when, dropped merge_window after if no run took them
+    queue<pair<uint64_t, int64_t>> ended_rpcs;
+    // RPC_END of the runs whose server RPC has not ended yet (client log and entry),
+    // by RPC id, and how many each run waits for, and whether it ended
+    unordered_map<int64_t, pair<size_t, log_entry>> waiting_rpcs;
+    unordered_map<const sample *, pair<uint32_t, bool>> waiting_runs;
+    // Type of the last entry of each client log, and when it was read
+    vector<pair<uint64_t, event_type>> last_entries(client_logs.size(), make_pair(0, USER_EVENT));
+    vector<string_view> params;
+    uint64_t window = merge_window * 1000000;
+
+    auto end_run = [&](const log_entry & entry, size_t log) {
+        write_run(func_list[entry.func_name], run_key(log, entry.process_tag, entry.uid), spools, first_client_log.time_unit, 
+            client_logs, trace_log);
+    };
+
+    // The RPC_END of a run, once the server RPC ended
+    auto take_rpc = [&](int64_t rpc_id) {
+        auto w = waiting_rpcs.find(rpc_id);
+        const log_entry & entry = w->second.second;
+        size_t log = w->second.first;
+        sample * s = add_client_entry(func_list, entry, log, params);
+        server_rpcs.erase(rpc_id);
+        auto run = waiting_runs.find(s);
+        if (--run->second.first == 0) {
+            bool ended = run->second.second;
+            waiting_runs.erase(run);
+            if (ended) {
+                end_run(entry, log);
+            }
+        }
+        waiting_rpcs.erase(w);
+    };
+
+    uint64_t origin = 0;
+    merge_streams(streams, origin, [&](const pending_entry & next) {
+        log_entry & entry = next.entry;
+        const log_stream & stream = streams[next.stream];
+
+        while (!ended_rpcs.empty() && ended_rpcs.front().first + window < next.time) {
+            server_rpcs.erase(ended_rpcs.front().second);
+            ended_rpcs.pop();
+        }
+
+        if (stream.side == server) {
+            add_server_entry(server_rpcs, entry);
+            auto it = entry.type == FUNC_END ? server_rpcs.find(entry.rpc_id) : server_rpcs.end();
+            if (it != server_rpcs.end() && it->second.ended) {
+                if (waiting_rpcs.count(entry.rpc_id)) {
+                    take_rpc(entry.rpc_id);
+                } else {
+                    ended_rpcs.emplace(next.time, entry.rpc_id);
+                }
+            }
+            return;
+        }
+
+        size_t log = stream.index;
+        if (next.seq >= last_entries[log].first) {
+            last_entries[log] = make_pair(next.seq, entry.type);
+        }
+
+        // The run waits for the server RPC to end, as the server wrote its log later
+        if (entry.type == RPC_END) {
+            auto it = server_rpcs.find(entry.args[0]);
+            auto f = func_list.find(entry.func_name);
+            if (it != server_rpcs.end() && !it->second.ended && !waiting_rpcs.count(entry.args[0]) && 
+                f != func_list.end() && f->second->sample_list.count(run_key(log, entry.process_tag, entry.uid))) {
+                ++waiting_runs[f->second->sample_list.at(run_key(log, entry.process_tag, entry.uid))].first;
+                waiting_rpcs[entry.args[0]] = make_pair(log, move(entry));
+                return;
+            }
+        }
+
+        sample * s = add_client_entry(func_list, entry, log, params);
+        if (!s) {
+            ++streams[next.stream].reader.skipped;
+            return;
+        }
+
+        switch (entry.type) {
+            case FUNC_START:
+                // Link nested runs, the parent started before on the same thread
+                if (!entry.parent_name.empty()) {
+                    auto p = func_list.find(entry.parent_name);
+                    run_key parent_key(log, entry.process_tag, entry.parent_uid);
+                    if (p != func_list.end() && p->second->sample_list.count(parent_key)) {
+                        p->second->sample_list[parent_key]->children.push_back(entry.func_name + to_string(entry.uid));
+                    }
+                }
+                break;
+
+            case RPC_END:
+                // Taken by the run
+                server_rpcs.erase(entry.args[0]);
+                break;
+
+            case FUNC_END: {
+                auto run = waiting_runs.find(s);
+                if (run != waiting_runs.end()) {
+                    run->second.second = true;
+                } else {
+                    end_run(entry, log);
+                }
+                break;
             }
-            merged_log << line + " [server]" << endl;
+
+            default:
+                break;
+        }
+    });
+
+    // The server RPCs that never ended count as they are, as in generate_perf_trace
+    while (!waiting_rpcs.empty()) {
+        take_rpc(waiting_rpcs.begin()->first);
+    }
+    for (size_t log = 0; log < client_logs.size(); ++log) {
+        if (last_entries[log].second != FUNC_END) {
+            cerr << "Error: incorrect log file format (no end)" << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Runs that did not end
+    for (const auto& f : func_list) {
+        while (!f.second->sample_list.empty()) {
+            write_run(f.second, f.second->sample_list.begin()->first, spools, first_client_log.time_unit, 
+                client_logs, trace_log);
         }
-        merged_log << tmp_line << endl;
     }
 
-    cout << "Simple merge completed successfully" << endl;
+    for (const auto& f : func_list) {
+        freud_spool & spool = spools[f.first];
+        // Sampled runs stand for the ones that were not recorded
+        if (spool.tot_runs > spool.samples) {
+            cout << f.first << ": estimated " << spool.tot_runs << " runs from " << spool.samples << " samples\n" << endl;
+            trace_log << f.first << ": estimated " << spool.tot_runs << " runs from " << spool.samples << " samples\n" << endl;
+        }
+        write_freud_file(f.first, spool);
+    }
+    cout << "Trace generation successful" << endl;
 
-    client_log.close();
-    server_log.close();
-    merged_log.close();
+    trace_log.close();
 }
 
 int main(int argc, char** argv) { 
-    if (argc > 1) {
-        if (strcmp(argv[1], "--simple") == 0) {
-            simple_merge();
+    bool simple = false;
+    bool stream = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--simple") == 0) {
+            simple = true;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            stream = true;
+        } else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            server_log_paths.push_back(argv[++i]);
+        } else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc) {
+            client_log_paths.push_back(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            num_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc && atoi(argv[i + 1]) >= 0) {
+            merge_window = atoi(argv[++i]);
         } else {
-            cerr << "Usage: " << argv[0] << " [--simple]" << endl;
+            cerr << "Usage: " << argv[0] << " [--simple | --stream] [--window ms] [--server log|dir]... [--client log|dir]... [--threads N]" << endl;
             return EXIT_FAILURE;
         }
+    }
+
+    if (simple) {
+        simple_merge();
+    } else if (stream) {
+        stream_perf_trace();
     } else {
         generate_perf_trace();
     }
@@ -20,15 +20,151 @@
 #define TRACE_MERGE_H_INCLUDED
 
 #include <string>
+#include <string_view>
 #include <vector>
-#include <regex>
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
+#include <fstream>
+#include <tuple>
 
 #include "custom_instr.h"
 
+/*
+    An event read back from a log, whatever its format.
+*/
+struct log_entry {
+    // In ns since the time base of the log
+    uint64_t timestamp = 0;
+    // e.g. do_stuff and 12 for do_stuff12
+    std::string func_name;
+    uint32_t uid = 0;
+    // Tag of the process that logged it, from the log header
+    uint32_t process_tag = 0;
+    // Only set on the server side
+    int64_t rpc_id = -1;
+    event_type type = USER_EVENT;
+    uint8_t flags = 0;
+    // Durations are converted to ns as well
+    uint64_t args[5] = {0, 0, 0, 0, 0};
+    // FUNC_START only: number of runs the span stands for,
+    // and the span it is nested in (empty if none)
+    uint32_t weight = 1;
+    std::string parent_name;
+    uint32_t parent_uid = 0;
+    // Features of FUNC_START, message of USER_EVENT
+    std::string text;
+    // Read from a chunk of the log, of a span started before it,
+    // see deferred_entry
+    bool deferred = false;
+};
+
+/*
+    An entry read from a chunk of the log (see log_chunk) that belongs to
+    a span started before the chunk, or for FUNC_START, whose parent span
+    may have. It is completed once the chunks before have been read.
+*/
+struct deferred_entry {
+    // Position in the entries of the chunk
+    size_t index = 0;
+    // Binary logs: the span, or the parent span
+    uint32_t span_id = 0;
+    // Text logs: the name of the span, e.g. Greet3 17
+    std::string name;
+};
+
+/*
+    Reads the entries of a text or binary log.
+*/
+struct log_reader {
+    // The files of the log, read one after the other: the segments
+    // of a log directory, or just the log file
+    std::vector<std::string> segments;
+    size_t next_segment = 0;
+    // The file being read, mapped in memory, and the position in it
+    const char * data = nullptr;
+    size_t size = 0;
+    size_t pos = 0;
+    bool binary = false;
+    // From the log header. Text logs without one were
+    // written by older versions, which logged in ms
+    Time_unit time_unit = unit_ms;
+    uint64_t time_base = 0;
+    uint32_t process_tag = 0;
+    // Text logs: side of the header, -1 without one, see parse_text_entry
+    int side = -1;
+    // Binary logs only: interned function names, and function id,
+    // uid, RPC id and start time of the spans still open
+    std::vector<std::string> func_names;
+    std::unordered_map<uint32_t, std::tuple<uint32_t, uint32_t, int64_t, uint64_t>> spans;
+    // Records were dropped by the shared-memory sink (see LOG_FLAG_LOSSY)
+    // or the log starts at a segment that continues a removed one,
+    // and how many records of spans whose start was lost were skipped
+    bool lossy = false;
+    uint64_t skipped = 0;
+    // Text logs only: start time of the spans still open,
+    // and the tokens of the current line
+    std::unordered_map<std::string, uint64_t> span_starts;
+    std::vector<std::string_view> tokens;
+    // Reading a chunk of the log (see log_chunk) that continues the
+    // capture before it: the entries of spans it did not start are
+    // deferred, and the spans it ended are remembered rather than
+    // taken for unknown
+    bool chunked = false;
+    std::vector<deferred_entry> deferred;
+    std::unordered_set<uint32_t> ended_spans;
+    std::unordered_set<std::string> ended_names;
+};
+
+/*
+    A part of a log file that can be parsed on its own (see --threads),
+    made of whole lines or records. Log headers only appear between
+    chunks, so what the reader knows at the start of the chunk only
+    changes with the function names it defines, apart from the spans.
+*/
+struct log_chunk {
+    const char * data = nullptr;
+    size_t size = 0;
+    // Follows the header of a new capture, which ended the spans open before
+    bool new_capture = false;
+    Time_unit time_unit = unit_ms;
+    uint64_t time_base = 0;
+    uint32_t process_tag = 0;
+    int side = -1;
+    bool lossy = false;
+    std::vector<std::string> func_names;
+};
+
+/*
+    What the server logged for an RPC, see preprocess_server_log.
+*/
+struct server_rpc {
+    uint64_t start_time = 0;
+    uint64_t exec_time = 0;
+    // Bytes allocated, freed, still live at the end and peak of live bytes
+    uint64_t memory[4] = {0, 0, 0, 0};
+    // Minor and major
+    uint64_t pagefaults[2] = {0, 0};
+    // CPU time (total, user and system), then voluntary and involuntary context switches
+    uint64_t cpu[5] = {0, 0, 0, 0, 0};
+    // See RPC_TIMES
+    uint64_t queue_time = 0;
+    uint64_t handler_time = 0;
+    bool has_hw_counters = false;
+    bool has_sw_counters = false;
+    uint64_t hw_counters[4] = {0, 0, 0, 0};
+    uint64_t sw_counters[4] = {0, 0, 0, 0};
+    // Set by the end of its span, after which its RPC id is no longer looked at
+    bool ended = false;
+};
+
 struct sample {
     uint32_t uid;
+    // Number of runs the sample stands for, see set_sampling
+    uint32_t weight = 1;
+    // Run this one is nested in (e.g. do_stuff12) and runs nested in it
+    std::string parent;
+    std::vector<std::string> children;
     uint64_t start_time = 0;
     uint64_t RPC_start_time = 0;
     uint64_t exec_time = 0;
@@ -38,34 +174,151 @@ struct sample {
     uint64_t waiting_time = 0;
     uint64_t server_lock_holding_time = 0;
     uint64_t server_waiting_time = 0;
+    // Bytes allocated, freed, still live at the end and peak of live bytes
     uint64_t memory_usage = 0;
     uint64_t server_memory_usage = 0;
+    uint64_t freed_memory = 0;
+    uint64_t server_freed_memory = 0;
     uint64_t mem_leaks = 0;
     uint64_t server_mem_leaks = 0;
+    uint64_t peak_memory = 0;
+    uint64_t server_peak_memory = 0;
     uint64_t min_pagefault = 0;
     uint64_t maj_pagefault = 0;
     uint64_t server_min_pagefault = 0;
     uint64_t server_maj_pagefault = 0;
+    // Time spent on CPU, in total and split into user and system time
+    uint64_t cpu_time = 0;
+    uint64_t server_cpu_time = 0;
+    uint64_t user_time = 0;
+    uint64_t server_user_time = 0;
+    uint64_t system_time = 0;
+    uint64_t server_system_time = 0;
+    uint64_t voluntary_switches = 0;
+    uint64_t server_voluntary_switches = 0;
+    uint64_t involuntary_switches = 0;
+    uint64_t server_involuntary_switches = 0;
+    // Performance counters (see set_perf_counters), 0 where not available
+    bool has_hw_counters = false;
+    bool has_sw_counters = false;
+    uint64_t cycles = 0;
+    uint64_t server_cycles = 0;
+    uint64_t instructions = 0;
+    uint64_t server_instructions = 0;
+    uint64_t cache_misses = 0;
+    uint64_t server_cache_misses = 0;
+    uint64_t branch_misses = 0;
+    uint64_t server_branch_misses = 0;
+    uint64_t task_clock = 0;
+    uint64_t server_task_clock = 0;
+    uint64_t context_switches = 0;
+    uint64_t server_context_switches = 0;
+    uint64_t cpu_migrations = 0;
+    uint64_t server_cpu_migrations = 0;
+    // RPCs logged by the interceptors (see jung_interceptors.h): how many
+    // failed, bytes sent and received, and server time before and in the handlers
+    uint64_t rpcs = 0;
+    uint64_t failed_rpcs = 0;
+    uint64_t request_bytes = 0;
+    uint64_t response_bytes = 0;
+    uint64_t server_queue_time = 0;
+    uint64_t server_handler_time = 0;
     std::vector<feature*> feature_list;
 
     sample(const uint32_t & u) : uid(u) {};
+    virtual ~sample() = default;
+
+    // Converts the times from ns to the given unit
+    void scale_times(Time_unit unit) {
+        uint64_t factor = time_unit_ns(unit);
+        exec_time /= factor;
+        network_time /= factor;
+        server_time /= factor;
+        lock_holding_time /= factor;
+        waiting_time /= factor;
+        server_lock_holding_time /= factor;
+        server_waiting_time /= factor;
+        cpu_time /= factor;
+        server_cpu_time /= factor;
+        user_time /= factor;
+        server_user_time /= factor;
+        system_time /= factor;
+        server_system_time /= factor;
+        task_clock /= factor;
+        server_task_clock /= factor;
+        server_queue_time /= factor;
+        server_handler_time /= factor;
+    }
+
+    // e.g. 42%, or - if the total is 0
+    static std::string percent(uint64_t part, uint64_t total) {
+        return total > 0 ? std::to_string(part * 100 / total) + "%" : "-";
+    }
 
-    virtual std::string print() const {
+    virtual std::string print(Time_unit unit) const {
+        const std::string TIMER_UNIT = time_unit_name(unit);
         std::string msg = "Took " + std::to_string(exec_time) + " " + TIMER_UNIT + ", of which approx. " + 
             std::to_string(network_time) + " " + TIMER_UNIT + " in network and approx. " + std::to_string(server_time) + 
-            " " + TIMER_UNIT + " in server.\nUsed " + std::to_string(memory_usage) + " bytes of memory client-side and " + 
-            std::to_string(server_memory_usage) + " bytes of memory server-side.\nThere were " + std::to_string(min_pagefault) + 
+            " " + TIMER_UNIT + " in server.\nAllocated " + std::to_string(memory_usage) + " bytes (freed " + std::to_string(freed_memory) + 
+            ", peak " + std::to_string(peak_memory) + ") client-side and " + std::to_string(server_memory_usage) + 
+            " bytes (freed " + std::to_string(server_freed_memory) + ", peak " + std::to_string(server_peak_memory) + 
+            ") server-side.\nThere were " + std::to_string(min_pagefault) + 
             " minor pagefaults and " + std::to_string(maj_pagefault) + " major ones client-side; " 
             + std::to_string(server_min_pagefault) + " minor pagefaults and " + std::to_string(server_maj_pagefault) + 
             " major ones server-side.\nWaited for " + std::to_string(waiting_time) + " " + TIMER_UNIT + " and held lock for " + 
-            std::to_string(lock_holding_time) + " " + TIMER_UNIT + ".";
+            std::to_string(lock_holding_time) + " " + TIMER_UNIT + ".\nWas on CPU for " + std::to_string(cpu_time) + " " + 
+            TIMER_UNIT + " (" + percent(cpu_time, exec_time) + " of the run; user " + std::to_string(user_time) + ", system " + 
+            std::to_string(system_time) + ") client-side and " + std::to_string(server_cpu_time) + " " + TIMER_UNIT + " (" + 
+            percent(server_cpu_time, server_time) + " of the server time; user " + std::to_string(server_user_time) + 
+            ", system " + std::to_string(server_system_time) + ") server-side.\nSwitched context " + 
+            std::to_string(voluntary_switches) + " time(s) voluntarily and " + std::to_string(involuntary_switches) + 
+            " involuntarily client-side; " + std::to_string(server_voluntary_switches) + " and " + 
+            std::to_string(server_involuntary_switches) + " server-side.";
+
+        if (has_hw_counters) {
+            msg += "\nCounted " + std::to_string(cycles) + " cycles, " + std::to_string(instructions) + " instructions, " + 
+                std::to_string(cache_misses) + " cache misses and " + std::to_string(branch_misses) + " branch misses client-side; " + 
+                std::to_string(server_cycles) + " cycles, " + std::to_string(server_instructions) + " instructions, " + 
+                std::to_string(server_cache_misses) + " cache misses and " + std::to_string(server_branch_misses) + 
+                " branch misses server-side.";
+        }
+
+        if (has_sw_counters) {
+            msg += "\nRan on CPU for " + std::to_string(task_clock) + " " + TIMER_UNIT + " with " + 
+                std::to_string(context_switches) + " context switches and " + std::to_string(cpu_migrations) + 
+                " CPU migrations client-side; for " + std::to_string(server_task_clock) + " " + TIMER_UNIT + " with " + 
+                std::to_string(server_context_switches) + " context switches and " + std::to_string(server_cpu_migrations) + 
+                " CPU migrations server-side.";
+        }
+
+        if (rpcs > 0) {
+            msg += "\nMade " + std::to_string(rpcs) + " RPC(s), " + std::to_string(failed_rpcs) + " failed, sending " + 
+                std::to_string(request_bytes) + " bytes and receiving " + std::to_string(response_bytes) + "; the server took " + 
+                std::to_string(server_queue_time) + " " + TIMER_UNIT + " to start the handlers, which ran for " + 
+                std::to_string(server_handler_time) + " " + TIMER_UNIT + ".";
+        }
 
         if (mem_leaks > 0) {
-            msg += "\nPossible client memory leak detected! " + std::to_string(mem_leaks) + " malloc call(s) not freed.";
+            msg += "\nPossible client memory leak detected! " + std::to_string(mem_leaks) + " byte(s) not freed.";
         }
 
         if (server_mem_leaks > 0) {
-            msg += "\nPossible server memory leak detected! " + std::to_string(server_mem_leaks) + " malloc call(s) not freed.";
+            msg += "\nPossible server memory leak detected! " + std::to_string(server_mem_leaks) + " byte(s) not freed.";
+        }
+
+        if (!parent.empty()) {
+            msg += "\nNested in " + parent + ".";
+        }
+
+        if (children.size() > 0) {
+            msg += "\nCalled " + std::to_string(children.size()) + " nested run(s):";
+            for (const std::string & child : children) {
+                msg += " " + child;
+            }
+        }
+
+        if (weight > 1) {
+            msg += "\nSampled, stands for " + std::to_string(weight) + " runs.";
         }
 
         if (feature_list.size() > 0) {
@@ -83,9 +336,30 @@ sample * make_sample(const uint32_t & u) {
     return new sample(u);
 }
 
+/*
+    Key of a run in the sample_list of its function: the index of
+    the client log it was read from (see find_logs), the tag of the
+    process that logged it, since captures of different processes can
+    be appended to the same log, then its uid, since the uids of
+    different processes collide.
+*/
+struct run_key {
+    size_t log = 0;
+    uint32_t process_tag = 0;
+    uint32_t uid = 0;
+
+    run_key(size_t l, uint32_t p, uint32_t u)
+    : log(l), process_tag(p), uid(u) {};
+
+    bool operator<(const run_key & other) const {
+        return std::tie(log, process_tag, uid) < std::tie(other.log, other.process_tag, other.uid);
+    }
+};
+
 struct custom_func {
     std::string name;
-    std::map<uint32_t, sample*> sample_list;
+    // By run_key
+    std::map<run_key, sample*> sample_list;
 
     custom_func(const std::string & n)
 	: name(n) {};
@@ -96,6 +370,103 @@ custom_func * make_custom_func(const std::string & n) {
     return new custom_func(n);
 }
 
+/*
+    What a thread aggregated of the runs of the client log it was
+    given (see --threads), to be merged with the other threads.
+*/
+struct client_shard {
+    std::unordered_map<std::string, custom_func *> func_list;
+    // Position in the log of the first run of each function,
+    // and of the start of each run
+    std::unordered_map<std::string, uint64_t> first_runs;
+    std::unordered_map<const sample *, uint64_t> run_starts;
+    // Position in the logs, parent (name and run_key) and name
+    // of the nested runs, linked once all the runs are known
+    std::vector<std::tuple<uint64_t, std::string, run_key, std::string>> nested_runs;
+    // Entries of runs whose FUNC_START was not read, see add_client_entry
+    uint64_t skipped = 0;
+};
+
+/*
+    A log read along with the other ones in the order of their
+    wall-clock time, see simple_merge and stream_perf_trace.
+*/
+struct log_stream {
+    log_reader reader;
+    Side side;
+    // Position among the logs of its side, see find_logs
+    size_t index = 0;
+    // Latest wall-clock time read from the log, in ns since the Unix epoch
+    uint64_t watermark = 0;
+};
+
+/*
+    An entry read from one of the logs, waiting for the ones of
+    the other logs (or later in its own) that come before it.
+*/
+struct pending_entry {
+    // Wall-clock time, in ns since the Unix epoch
+    uint64_t time;
+    size_t stream;
+    // Order in which the entries were read, for those at the same time
+    uint64_t seq;
+    // Moved out of the heap before the entry is popped
+    mutable log_entry entry;
+
+    bool operator>(const pending_entry & other) const {
+        return std::tie(time, stream, seq) > std::tie(other.time, other.stream, other.seq);
+    }
+};
+
+/*
+    Freud file of a function written by stream_perf_trace. Its samples
+    are spooled to disk as they complete, since the file starts with the
+    names of the features of all of them, and it is written at the end.
+*/
+struct freud_spool {
+    std::string spool_path;
+    std::ofstream spool;
+    // Feature names and types, by the id the spooled samples refer to
+    std::vector<std::string> fnames;
+    std::unordered_map<std::string, uint32_t> fname_ids;
+    std::vector<std::string> ftypes;
+    std::unordered_map<std::string, uint32_t> ftype_ids;
+    uint64_t samples = 0;
+    // Number of runs the samples stand for, see set_sampling
+    uint64_t tot_runs = 0;
+    uint32_t min_weight = UINT32_MAX;
+};
+
+/*
+    Lists the logs of the given side: the files and segment
+    directories given on the command line, directories of logs
+    being replaced by the logs they hold, else the segment
+    directory, the binary log or the text one, whichever is
+    found first. Exits if there is none.
+*/
+extern std::vector<std::string> find_logs(Side side);
+
+/*
+    Opens the log file or segment directory. Exits if it cannot be opened.
+*/
+extern void open_log(log_reader & reader, const std::string & path);
+
+/*
+    Reads the next entry from the log.
+    Returns false at the end of the log.
+*/
+extern bool read_entry(log_reader & reader, log_entry & entry);
+
+/*
+    Releases the file of the log being read.
+*/
+extern void close_log(log_reader & reader);
+
+/*
+    Formats the entry as a line of the text log.
+*/
+extern std::string format_entry(const log_entry & entry);
+
 /* 
     Produces a unified performance trace with the data
     from client and server RPC calls.
@@ -105,14 +476,31 @@ extern void generate_perf_trace();
 /*
     Encodes the performance stats in Freud's binary format
     so that it can be read by freud-statistics.
+    Samples that stand for more runs than the others of their
+    function (adaptive sampling) are repeated accordingly.
     See https://github.com/usi-systems/freud/blob/master/freud-pin/dumper.cc
 */
 extern void encode_perf_trace(std::unordered_map<std::string, custom_func *> func_list);
 
+/*
+    Produces the same trace as generate_perf_trace while reading all
+    the logs once, in the order of their wall-clock time (see
+    simple_merge), so that memory depends on the spans in flight and
+    not on the length of the logs: each run is written out as soon as
+    it ends (or once the server RPCs it waits for have), and each
+    server RPC is dropped once its run took it, or merge_window after
+    it ended if none did. The runs are thus written in the order they
+    ended rather than by function, and the server RPCs that ended more
+    than merge_window before their client got the reply are missed.
+*/
+extern void stream_perf_trace();
+
 /* 
-    Reads a line from the client log, then if there
-    is a RPC request, search the relevant lines in the
-    server log and append them.
+    Merges the entries of all the client and server logs
+    into a single timeline, in the order of their wall-clock
+    time. An entry is written once all the logs have been
+    read up to merge_window after it, since the entries of
+    a log are only ordered within each thread's batch.
 */
 extern void simple_merge();
 